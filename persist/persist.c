@@ -6,17 +6,53 @@
  *    the parent is killed, restart it.
  * 2. occasionally send messages to syslog
  * 3. the fork should rename itself.
+ *
+ * Build with
+ *	cc -O2 -pthread -o persist persist.c
+ * or, for hosts running many copies, a small static build against musl:
+ *	musl-gcc -static -Os -DPERSIST_SMALL -pthread -o persist persist.c
+ *	strip persist
+ * PERSIST_SMALL shrinks the pool, its queues and the scratch arena, and
+ * leaves out the benchmarks, bar "persist bench" measuring its size and
+ * idle RSS.
  */
 
 /* Feature macros. */
 #define _GNU_SOURCE
 
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/vfs.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/fsverity.h>
+#include <linux/perf_event.h>
+#include <mntent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -24,274 +60,7440 @@
 #include <time.h>
 #include <unistd.h>
 
+/*
+ * USDT probes for bpftrace and perf, under the "persist" provider, are
+ * built in wherever <sys/sdt.h> is available, unless NO_USDT is
+ * defined. Each is a nop until something attaches to it:
+ *	exit(id, pid, detect ns)
+ *	spawn(id, pid, spawn ns)
+ *	restore__start(id, pid, path), restore__end(id, pid, ns, result)
+ *	verify__start(id, pid, path), verify__end(id, pid, ns, result)
+ * For restores and verifies, id is the artifact's index in the manifest,
+ * 0 being the exe. For exits and spawns, it's 0 for persist's parent
+ * and 1 plus the service's index for services. pid is the supervised
+ * process.
+ */
+#if !defined(NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(persist, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	DTRACE_PROBE4(persist, name, a, b, c, d)
+#endif
+#endif
+#ifndef PROBE3
+#define PROBE3(name, a, b, c)		do { (void)(a); (void)(b); (void)(c); \
+					} while (0)
+#define PROBE4(name, a, b, c, d)	do { (void)(a); (void)(b); (void)(c); \
+					    (void)(d); } while (0)
+#endif
+
 /*
  * BIN_NAME is the name this is built under, and WATCHER_NAME is the name
  * the watcher process will take up.
  */
-#define BIN_NAME	"persist"
-#define WATCHER_NAME	"bash"
+#define BIN_NAME	"persist"
+#define WATCHER_NAME	"bash"
+
+#ifndef MAX_PATH
+#define MAX_PATH	4096
+#endif
+
+/*
+ * MANIFEST lists additional artifacts to keep in place, one path per
+ * line, optionally followed by "critical" if check_run depends on it.
+ * A line "service name [option ...] path [arg ...]" instead names a
+ * service for the watcher to run, and restart whenever it exits. The
+ * options are "priority=N", lower starting first, 0 by default,
+ * "after=name[,name ...]", for services that must be up first,
+ * "critical", for services that are started even under pressure,
+ * "stop=SIGNAL", the signal that asks it to stop, TERM by default,
+ * "stop-timeout=SECS", how long it gets before it's killed, and
+ * "instances=N". Services are stopped after everything that comes
+ * after them. A service with instances is a template for N services,
+ * name@0 and up, each with "%i" in its arguments replaced by its
+ * number; coming after the template means coming after every one of
+ * them. The number can be changed while persist runs, or left to
+ * persist: a template with "max=N", and "min=N", 1 by default, is
+ * scaled between them on "scale-on=cpu", each instance's CPU use, or
+ * "scale-on=queue", the work it reports having queued, to keep each
+ * one's near "target=N", in percent of a CPU or queued items.
+ */
+#ifndef MANIFEST
+#define MANIFEST	"/etc/persist.manifest"
+#endif
+
+/*
+ * Restore and verification I/O is throttled by token buckets, globally
+ * and per device, in bytes and operations per second. A rate of 0
+ * disables that bucket. Restores are copied RESTORE_CHUNK bytes at a
+ * time so a large artifact can't take the whole burst in one go.
+ */
+#ifndef IO_GLOBAL_BPS
+#define IO_GLOBAL_BPS	(64 * 1024 * 1024)
+#endif
+#ifndef IO_GLOBAL_IOPS
+#define IO_GLOBAL_IOPS	2000
+#endif
+#ifndef IO_DEV_BPS
+#define IO_DEV_BPS	(32 * 1024 * 1024)
+#endif
+#ifndef IO_DEV_IOPS
+#define IO_DEV_IOPS	1000
+#endif
+#define RESTORE_CHUNK	(1024 * 1024)
+#define MAX_DEVICES	32
+
+/* CHECK_INTERVAL is how often, in seconds, check_run looks at the parent. */
+#define CHECK_INTERVAL	60
+
+/*
+ * Periodic work is spread out rather than all firing at once: each task
+ * gets a phase within its period from a hash of its name, and each
+ * round a further delay of up to PERIODIC_JITTER percent of the period,
+ * also from the hash. The same task lands at the same times every run.
+ * Every artifact is re-verified every VERIFY_INTERVAL seconds, in case
+ * a change was missed, and every service's CPU use sampled every
+ * SVC_SAMPLE_INTERVAL.
+ */
+#ifndef PERIODIC_JITTER
+#define PERIODIC_JITTER	10
+#endif
+#ifndef VERIFY_INTERVAL
+#define VERIFY_INTERVAL	3600
+#endif
+#define SVC_SAMPLE_INTERVAL	10
+
+/*
+ * Monitor events on an artifact are coalesced: it's checked once no
+ * event has arrived for COALESCE_MS, or as soon as a writer closes it,
+ * but never later than COALESCE_MAX_MS after the first event.
+ */
+#ifndef COALESCE_MS
+#define COALESCE_MS	250
+#endif
+#ifndef COALESCE_MAX_MS
+#define COALESCE_MAX_MS	5000
+#endif
+
+/*
+ * DIGEST_CACHE maps an inode's identity (device, inode, size, mtime and
+ * ctime) to its digest, so an artifact that hasn't changed since it was
+ * last hashed is verified with a statx instead of a read.
+ */
+#ifndef DIGEST_CACHE
+#define DIGEST_CACHE	"/var/cache/persist.digests"
+#endif
+#define DIGEST_LEN	32
+
+/*
+ * Where the filesystem supports it, fs-verity is enabled on artifacts
+ * and the kernel's Merkle tree root is compared instead of hashing the
+ * file. Verity files can't be written to, so in-place changes become
+ * impossible and anything else is a replacement that can be restored.
+ */
+#ifndef USE_VERITY
+#define USE_VERITY	1
+#endif
+
+/*
+ * Artifacts are hashed as a binary tree of TREE_LEAF-sized leaves, in
+ * BLAKE2s tree mode, so the leaves of a large file can be spread over
+ * the job pool. Files smaller than HASH_PARALLEL_MIN are hashed on the
+ * calling thread.
+ */
+#define TREE_LEAF	(64 * 1024)
+#define TREE_BATCH	16
+#ifndef HASH_PARALLEL_MIN
+#define HASH_PARALLEL_MIN	(4 * 1024 * 1024)
+#endif
+
+/*
+ * Checks, restores and hashing run on a pool of POOL_THREADS workers (0
+ * means one per online CPU), so the event loop never blocks on them.
+ * The loop feeds the pool through lock-free queues of POOL_QUEUE slots,
+ * one per job class; workers push follow-on work to their own deques,
+ * which idle workers steal from.
+ */
+#ifdef PERSIST_SMALL
+#define POOL_THREADS	1
+#define POOL_QUEUE	64
+#define DEQUE_SIZE	128
+#define POOL_STACK	(64 * 1024)
+#else
+#ifndef POOL_THREADS
+#define POOL_THREADS	0
+#endif
+#define POOL_QUEUE	1024
+#define DEQUE_SIZE	1024
+#define POOL_STACK	0
+#endif
+
+/*
+ * Scratch memory that only lives as long as one event (paths, keys,
+ * formatted strings) comes from a per-thread arena of ARENA_SIZE bytes,
+ * reset at the end of each event loop iteration or pool job. Anything
+ * that doesn't fit spills to malloc and is freed at the same point.
+ */
+#ifdef PERSIST_SMALL
+#define ARENA_SIZE	(8 * 1024)
+#else
+#define ARENA_SIZE	(64 * 1024)
+#endif
+
+/*
+ * Files are hashed from reads of HASH_READ bytes into the arena rather
+ * than a mapping, which would raise SIGBUS if the file were truncated
+ * under it.
+ */
+#define HASH_READ	(ARENA_SIZE / 2)
+
+/*
+ * Operation latencies are recorded in log-linear histograms: each power
+ * of two is split into 2^(HIST_BITS-1) linear buckets, so a recorded
+ * value is within 1 part in 2^(HIST_BITS-1) of the true one, up to
+ * 2^HIST_MAX_BITS ns. Threads record into their own shards, which the
+ * event loop merges every HIST_MERGE seconds and whenever asked for
+ * them.
+ */
+#ifdef PERSIST_SMALL
+#define HIST_BITS	4
+#else
+#define HIST_BITS	6
+#endif
+#define HIST_MAX_BITS	40
+#define HIST_BUCKETS	((HIST_MAX_BITS - HIST_BITS + 2) << (HIST_BITS - 1))
+#define HIST_MERGE	10
+
+/*
+ * The event loop times each handler it runs, and flags any that runs
+ * longer than LOOP_BUDGET_MS: while one does, nothing else is being
+ * supervised.
+ */
+#ifndef LOOP_BUDGET_MS
+#define LOOP_BUDGET_MS	20
+#endif
+
+/*
+ * The tracer, when turned on, records spans into a ring of TRACE_EVENTS
+ * per thread, overwriting the oldest, to be dumped in the Chrome trace
+ * format. Rings are only allocated once tracing is first turned on.
+ */
+#ifdef PERSIST_SMALL
+#define TRACE_EVENTS	512
+#else
+#define TRACE_EVENTS	8192
+#endif
+
+/*
+ * The watcher listens on CONTROL_SOCKET for one-line commands: "status",
+ * "metrics", "trace on", "trace off", "trace", "profile on",
+ * "profile off", "stop" and "scale NAME N". Running persist with a
+ * command as its only argument sends it and prints the reply.
+ */
+#ifndef CONTROL_SOCKET
+#define CONTROL_SOCKET	"/run/persist.sock"
+#endif
+
+/*
+ * A parent started by check_run finds the watcher's pid in WATCHER_ENV,
+ * and leaves that watcher be rather than starting another.
+ */
+#define WATCHER_ENV	"PERSIST_WATCHER"
+
+/*
+ * Services scaled on their queues find NOTIFY_SOCKET in NOTIFY_ENV, as
+ * for sd_notify, and report with "QUEUE=n" datagrams. Senders are told
+ * apart by their credentials. Only persist's user may write to it, and
+ * NOTIFY_GID's members too if it's set, for services that drop their
+ * privileges.
+ */
+#ifndef NOTIFY_SOCKET
+#define NOTIFY_SOCKET	"/run/persist.notify"
+#endif
+#ifndef NOTIFY_GID
+#define NOTIFY_GID	-1
+#endif
+#define NOTIFY_ENV	"NOTIFY_SOCKET"
+
+/*
+ * spam's heartbeat to the console. Under simulation, time is virtual,
+ * so a day of these runs in moments.
+ */
+#define SPAM_INTERVAL	3600
+
+/*
+ * A service that can't be started, or dies within SVC_STABLE_MS of
+ * starting, is tried again after a delay: SVC_RETRY_MS at first, then
+ * doubling each time up to SVC_BACKOFF_MAX_MS. One that stays up that
+ * long is restarted straight away.
+ */
+#define SVC_RETRY_MS	1000
+#ifndef SVC_BACKOFF_MAX_MS
+#define SVC_BACKOFF_MAX_MS	(60 * 1000)
+#endif
+#ifndef SVC_STABLE_MS
+#define SVC_STABLE_MS	(10 * 1000)
+#endif
+#define SVC_MAX_ARGS	32
+#define SVC_MAX_OPTS	8
+
+/* No template runs more than TMPL_MAX_INSTANCES instances. */
+#define TMPL_MAX_INSTANCES	1024
+
+/*
+ * Services are started through a queue, at most RESTART_LIMIT at a time,
+ * so a mass failure doesn't spawn everything at once. 0 means twice the
+ * number of CPUs. A start holds its slot until the service has been up
+ * for SVC_SETTLE_MS, or has failed.
+ */
+#ifndef RESTART_LIMIT
+#define RESTART_LIMIT	0
+#endif
+#ifndef SVC_SETTLE_MS
+#define SVC_SETTLE_MS	50
+#endif
+
+/*
+ * A service being stopped that hasn't exited SVC_STOP_TIMEOUT seconds
+ * after its stop signal is killed.
+ */
+#ifndef SVC_STOP_TIMEOUT
+#define SVC_STOP_TIMEOUT	10
+#endif
+
+/*
+ * Autoscaled templates are looked at every AUTOSCALE_INTERVAL seconds.
+ * One grows as soon as its load is AUTOSCALE_BAND percent over target
+ * for the instances it has, unless there's pressure, and shrinks by one
+ * once load has been that far under target for one instance fewer
+ * AUTOSCALE_HOLD looks running. The default targets are AUTOSCALE_CPU
+ * percent of a CPU and AUTOSCALE_QUEUE queued items.
+ */
+#ifndef AUTOSCALE_INTERVAL
+#define AUTOSCALE_INTERVAL	10
+#endif
+#define AUTOSCALE_BAND		20
+#define AUTOSCALE_HOLD		3
+#define AUTOSCALE_CPU		80
+#define AUTOSCALE_QUEUE		10
+
+/*
+ * Under memory, CPU or I/O pressure, hashing of anything but critical
+ * artifacts is paused, and only critical services are started. Pressure
+ * is a PSI trigger firing: tasks stalled for PSI_STALL_MS in a
+ * PSI_WINDOW_MS window, which has to be a multiple of two seconds for
+ * an unprivileged trigger. It lasts PSI_HOLD_MS past the last firing.
+ * Paused workers look for restart-path work every PSI_POLL_MS.
+ */
+#ifndef PSI_STALL_MS
+#define PSI_STALL_MS	200
+#endif
+#ifndef PSI_WINDOW_MS
+#define PSI_WINDOW_MS	2000
+#endif
+#ifndef PSI_HOLD_MS
+#define PSI_HOLD_MS	5000
+#endif
+#define PSI_POLL_MS	10
+
+#define MSEC		1000000ULL
+#define SEC		(1000 * MSEC)
+
+
+static pid_t	 pid = 0;
+static int	 sim = 0;
+static uint64_t	 sim_clock = 0;
+static char	*name = NULL;
+static char	 exe[PATH_MAX];
+static ssize_t	 exelen = 0;
+static off_t	 name_diff = 0;
+
+
+/*
+ * Job classes, most urgent first. Restart-path jobs are taken ahead of
+ * everything else, and bulk work in lower classes checks for them
+ * between chunks and gets out of the way.
+ */
+enum {
+	JOB_RESTART = 0,
+	JOB_PROBE,
+	JOB_VERIFY,
+	JOB_HOUSEKEEPING,
+	NJOBCLASS
+};
+
+/*
+ * A job is a unit of work for the pool. fn runs on a worker; done, if
+ * set, runs afterwards on the event loop thread. finished, if set, is
+ * decremented once the worker has let go of the job, so whoever owns
+ * its memory can wait on that and then free it.
+ */
+struct job {
+	void		(*fn)(struct job *);
+	void		(*done)(struct job *);
+	struct job	*next;
+	atomic_long	*finished;
+	int		 class;
+};
+
+
+/*
+ * A periodic task runs fn(arg) once a round, every period ns. key and
+ * round fix when each run lands.
+ */
+struct periodic {
+	const char	*name;
+	uint64_t	 period;
+	void		(*fn)(void *);
+	void		*arg;
+	uint64_t	 key;
+	uint64_t	 round;
+};
+
+
+/*
+ * An ident is what the digest cache knows a file by; if any of it
+ * changes, the contents may have too.
+ */
+struct ident {
+	uint64_t	 dev;
+	uint64_t	 ino;
+	uint64_t	 size;
+	int64_t		 mtime;
+	int64_t		 ctime;
+};
+
+
+/*
+ * An artifact is a file persist keeps in place. src is held open on the
+ * original inode, so it can be copied back even after the path has been
+ * unlinked; for the exe this is /proc/pid/exe. critical artifacts block
+ * a restart and are restored ahead of everything else.
+ */
+struct artifact {
+	struct job	 job;
+	char		*path;
+	int		 src;
+	dev_t		 dev;
+	mode_t		 mode;
+	int		 critical;
+
+	/*
+	 * Expected contents, and the identity of src when it was hashed.
+	 * With verity, digest is the kernel's measurement instead.
+	 */
+	int		 digested;
+	int		 verity;
+	unsigned char	 digest[DIGEST_LEN];
+	struct ident	 id;
+
+	/*
+	 * Monitor key: the watched directory's identity plus the name.
+	 * restored asks for it to be worked out again, since the restore
+	 * may have gone into a directory that replaced the watched one.
+	 */
+	unsigned char	*key;
+	size_t		 keylen;
+	int		 restored;
+
+	/* Coalescing state; due and deadline are on the monotonic clock. */
+	int		 pending;
+	uint64_t	 due;
+	uint64_t	 deadline;
+
+	/*
+	 * A check is running on the pool; again asks for another once it
+	 * finishes, and then is called on the event loop when it does.
+	 */
+	int		 busy;
+	int		 again;
+	int		 again_class;
+	void		(*then)(void);
+
+	/* The periodic re-verify. */
+	struct periodic	 scrub;
+};
+
+static struct artifact	*artifacts = NULL;
+static size_t		 nartifacts = 0;
+
+
+/*
+ * Artifacts are watched per filesystem with fanotify where persist is
+ * allowed to, and per directory with inotify where it isn't. Either
+ * way an event names a directory and an entry in it, and index maps
+ * that back to the artifact in O(1), however long the manifest is.
+ */
+static int		 mon_fd = -1;
+static int		 mon_fanotify = 0;
+static size_t		*mon_index = NULL;
+static size_t		 mon_index_size = 0;
+
+/*
+ * A file renamed or created over an artifact shows up as MOVED_TO or
+ * CREATE on its name. A filesystem mark leaves out FAN_MODIFY, which
+ * would wake the loop on every write anywhere on it; the writer's
+ * close is enough.
+ */
+#define FAN_EVENTS	(FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_CREATE| \
+			 FAN_ATTRIB|FAN_CLOSE_WRITE)
+#define IN_EVENTS	(IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_CREATE| \
+			 IN_MODIFY|IN_ATTRIB|IN_CLOSE_WRITE)
+
+
+/*
+ * Self-profiling, once turned on, reads these hardware counters on each
+ * thread around every handler and job. A sample is a point to measure
+ * from; counted is clear if the counters weren't read.
+ */
+enum {
+	PMC_CYCLES = 0,
+	PMC_INSTRUCTIONS,
+	PMC_CACHE_MISSES,
+	NPMC
+};
+
+struct sample {
+	uint64_t	 ns;
+	uint64_t	 pmc[NPMC];
+	int		 counted;
+};
+
+/*
+ * A loopstat accounts for time the event loop spends in one kind of
+ * handler. Handlers that come and go, like control clients, share one.
+ * pruns counts the runs pmc was read for.
+ */
+struct loopstat {
+	const char	*name;
+	uint64_t	 runs;
+	uint64_t	 ns;
+	uint64_t	 max;
+	uint64_t	 over;
+	uint64_t	 pruns;
+	uint64_t	 pmc[NPMC];
+	struct loopstat	*next;
+	int		 linked;
+};
+
+/*
+ * A handler is something the event loop in watch polls on.
+ */
+struct handler {
+	int		 fd;
+	const char	*name;
+	void		(*fn)(struct handler *);
+	struct loopstat	*stat;
+	uint32_t	 events;	/* EPOLLIN if 0 */
+};
+
+static int		 epfd = -1;
+static struct loopstat	*loopstats = NULL;
+static uint64_t		 loop_woke = 0;
+static int		 loop_done = 0;
+static int		 sim_orphaned = 0;
+
+
+/*
+ * A service is a process the watcher runs and restarts when it exits,
+ * noticed through a pidfd on the event loop. Where there's a cgroup v2
+ * hierarchy, each service runs in its own cgroup, and lives until that
+ * empties: a service that daemonizes, or whose main process dies
+ * leaving workers behind, isn't restarted over the top of them.
+ * Services are allocated one at a time, since the loop holds pointers
+ * to their handlers.
+ */
+struct service {
+	struct handler	 h;
+	char		*name;
+	char		**argv;
+	size_t		 idx;
+	pid_t		 pid;
+	uint64_t	 died;
+	uint64_t	 restarts;
+
+	/*
+	 * The cgroup's path and directory, or -1, its cgroup.events watch,
+	 * and whether it's been killed through cgroup.kill.
+	 */
+	char		*cg_path;
+	int		 cg;
+	int		 cg_wd;
+	int		 cg_killed;
+
+	/*
+	 * Start ordering: the services that must be up first, by name,
+	 * and once svc_resolve has found them, themselves. A service is
+	 * queued while it waits for a start slot, and starting while it
+	 * holds one, until settle_due.
+	 */
+	int		 priority;
+	int		 critical;
+	char		**after_names;
+	size_t		 nafter_names;
+	struct service	**after;
+	size_t		 nafter;
+	int		 resolved;
+	int		 queued;
+	int		 starting;
+	int		 visiting;
+	uint64_t	 settle_due;
+
+	/*
+	 * Restart backoff: when s last started, the delay before it's
+	 * tried again if it dies too soon, and when that try is due.
+	 */
+	uint64_t	 started;
+	uint64_t	 backoff;
+	uint64_t	 retry_due;
+
+	/*
+	 * Stopping: how, and, once persist is shutting down, how many
+	 * running services that come after this one it's waiting on.
+	 */
+	int		 stop_signal;
+	uint64_t	 stop_timeout;
+	uint64_t	 stop_due;
+	size_t		 holders;
+	int		 stopping;
+
+	/*
+	 * An instance is retired when its template is scaled down past it.
+	 * It's kept, stopped, for if it's scaled back up.
+	 */
+	struct template	*tmpl;
+	int		 retired;
+
+	/*
+	 * CPU use, sampled periodically: the pid, CPU time and clock at
+	 * the last sample, and the share of a CPU used since the one
+	 * before.
+	 */
+	struct periodic	 sample;
+	pid_t		 sample_pid;
+	uint64_t	 sample_cpu;
+	uint64_t	 sample_at;
+	double		 cpu;
+
+	/* The queue depth it last reported on the notify socket. */
+	uint64_t	 queue;
+
+	/*
+	 * Under simulation, how many more starts should fail, and whether
+	 * the stop signal is ignored.
+	 */
+	int		 fail;
+	int		 hang;
+};
+
+static struct service	**services = NULL;
+static size_t		  nservices = 0;
+
+/*
+ * A template is a service run as any number of instances: argv and
+ * opts as in the manifest, the instances made so far, and how many of
+ * them should be running.
+ */
+struct template {
+	char		 *name;
+	char		**argv;
+	char		**opts;
+	int		  nopts;
+	struct service	**inst;
+	size_t		  ninst;
+	size_t		  want;
+
+	/*
+	 * Autoscaling, if min is under max: the load each instance should
+	 * carry, whether that's queued items rather than CPU percent, the
+	 * load last seen, and how many times running it's been low.
+	 */
+	size_t		  min;
+	size_t		  max;
+	double		  target;
+	int		  by_queue;
+	double		  load;
+	int		  low;
+	struct periodic	  autoscale;
+};
+
+static struct template	**templates = NULL;
+static size_t		  ntemplates = 0;
+
+/* The start queue, in priority order, and how many slots are taken. */
+static struct service	**runq = NULL;
+static size_t		  nrunq = 0;
+static size_t		  runqcap = 0;
+static size_t		  restart_limit = RESTART_LIMIT;
+static size_t		  restarts_active = 0;
+
+/*
+ * Whether services have been started, whether persist is shutting down,
+ * and how many services are left.
+ */
+static int		  started = 0;
+static int		  stopping = 0;
+static size_t		  nstopping = 0;
+
+/*
+ * A psi is a pressure trigger on the event loop. Pressure lasts until
+ * pressure_until, on the monotonic clock, or is 0 when there's none.
+ */
+struct psi {
+	struct handler	 h;
+	const char	*resource;
+	uint64_t	 events;
+};
+
+static struct psi	 psis[] = {
+	{.resource = "memory"}, {.resource = "cpu"}, {.resource = "io"}
+};
+static uint64_t		 pressure_until = 0;
+
+/*
+ * The directory services' cgroups go in, the length of the cgroup2
+ * mount point it starts with, and the inotify instance watching them,
+ * by watch.
+ */
+static char		 *cg_root = NULL;
+static size_t		  cg_mntlen = 0;
+static int		  cg_ifd = -1;
+static struct service	**cg_bywd = NULL;
+static size_t		  cg_nwd = 0;
+
+
+/*
+ * Each worker owns a Chase-Lev deque: it pushes and pops at the
+ * bottom, and other workers steal from the top.
+ */
+struct worker {
+	pthread_t		 tid;
+	atomic_long		 top;
+	atomic_long		 bottom;
+	struct job *_Atomic	 buf[DEQUE_SIZE];
+};
+
+/* An injection queue is a bounded MPMC ring. */
+struct slot {
+	atomic_size_t	 seq;
+	struct job	*job;
+};
+
+struct ring {
+	struct slot	 slots[POOL_QUEUE];
+	atomic_size_t	 head;
+	atomic_size_t	 tail;
+};
+
+static struct worker		*workers = NULL;
+static long			 nworkers = 0;
+static struct ring		 inject[NJOBCLASS];
+static atomic_long		 pool_queued;
+static atomic_long		 pool_sleepers;
+static atomic_int		 pool_paused;
+static pthread_mutex_t		 pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 pool_cond = PTHREAD_COND_INITIALIZER;
+static struct job *_Atomic	 pool_done = NULL;
+static int			 pool_efd = -1;
+static struct job		*backlog[NJOBCLASS];
+static struct job		*backlog_tail[NJOBCLASS];
+static _Thread_local struct worker	*self = NULL;
+static _Thread_local int		 running = JOB_HOUSEKEEPING;
+static _Thread_local int		 depth = 0;
+
+
+/*
+ * An arena is bump-allocated from base; spills are chained so they can
+ * be freed on reset.
+ */
+struct spill {
+	struct spill	*next;
+	max_align_t	 data[];
+};
+
+struct arena {
+	char		*base;
+	size_t		 used;
+	struct spill	*spills;
+};
+
+static _Thread_local struct arena	 scratch;
+
+
+/*
+ * Timers are kept in a binary min-heap on when. Cancelling isn't
+ * supported; a callback that's no longer wanted should notice and
+ * return.
+ */
+struct timer {
+	uint64_t	 when;
+	void		(*fn)(void *);
+	void		*arg;
+};
+
+static struct timer	*timers = NULL;
+static size_t		 ntimers = 0;
+static size_t		 timercap = 0;
+
+
+/*
+ * A bucket holds up to burst tokens and refills at rate tokens per
+ * second. Critical I/O is allowed to drive a bucket negative rather
+ * than wait, which pushes the debt onto whatever comes after it.
+ */
+struct bucket {
+	double		 rate;
+	double		 burst;
+	double		 tokens;
+	struct timespec	 last;
+};
+
+struct iolimit {
+	dev_t		 dev;
+	struct bucket	 bytes;
+	struct bucket	 ops;
+};
+
+/*
+ * The digest cache file is a header followed by an open-addressed table
+ * of entries, hashed on device and inode, and mapped whole.
+ */
+struct cache_hdr {
+	uint32_t	 magic;
+	uint32_t	 version;
+	uint64_t	 nslots;
+	uint64_t	 nused;
+};
+
+struct cache_ent {
+	struct ident	 id;
+	unsigned char	 digest[DIGEST_LEN];
+};
+
+#define CACHE_MAGIC	0x70727374
+#define CACHE_VERSION	2
+#define CACHE_SLOTS	1024
+
+static int			 cache_fd = -1;
+static pthread_mutex_t		 cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct cache_hdr		*cache = NULL;
+static struct cache_ent		*cache_ents = NULL;
+
+/* Supervisor operations whose latencies are recorded. */
+enum {
+	OP_DETECT = 0,
+	OP_SPAWN,
+	OP_RESTART,
+	OP_RESTORE,
+	OP_VERIFY,
+	OP_LOOP,
+	NOPS
+};
+
+static const char	*class_names[NJOBCLASS] = {
+	"restart", "probe", "verify", "housekeeping"
+};
+
+static const char	*op_names[NOPS] = {
+	"detect", "spawn", "restart", "restore", "verify", "loop"
+};
+
+/*
+ * A shard is one thread's histograms. Only its thread adds to it; the
+ * event loop drains it into hists by swapping each counter for zero.
+ */
+struct shard {
+	struct shard		*next;
+	_Atomic uint64_t	 sum[NOPS];
+	_Atomic uint64_t	 max[NOPS];
+	_Atomic uint64_t	 buckets[NOPS][HIST_BUCKETS];
+};
+
+struct hist {
+	uint64_t	 count;
+	uint64_t	 sum;
+	uint64_t	 max;
+	uint64_t	 buckets[HIST_BUCKETS];
+};
+
+/*
+ * A span is one traced operation. seq is odd while it's being written,
+ * so a dump racing the writer can tell and skip it.
+ */
+struct span {
+	_Atomic uint64_t	 seq;
+	const char		*name;
+	const char		*arg;
+	uint64_t		 start;
+	uint64_t		 end;
+};
+
+struct tracebuf {
+	struct tracebuf		*next;
+	long			 tid;
+	_Atomic uint64_t	 head;
+	struct span		 spans[TRACE_EVENTS];
+};
+
+static atomic_int			 profile_on = 0;
+static _Thread_local int		 pmc_fd = -1;
+static _Atomic uint64_t			 job_pruns[NJOBCLASS];
+static _Atomic uint64_t			 job_pmc[NJOBCLASS][NPMC];
+
+static atomic_int			 trace_on = 0;
+static struct tracebuf *_Atomic		 tracebufs = NULL;
+static _Thread_local struct tracebuf	*tracebuf = NULL;
+
+static struct shard *_Atomic		 shards = NULL;
+static _Thread_local struct shard	*shard = NULL;
+static struct hist			 hists[NOPS];
+static uint64_t				 probe_start = 0;
+
+
+/*
+ * A conn is a client of the control socket. The command is read into
+ * in, and the reply written out of out, without blocking the loop.
+ */
+struct conn {
+	struct handler	 h;
+	char		 in[128];
+	size_t		 inlen;
+	char		*out;
+	size_t		 outlen;
+	size_t		 outoff;
+	size_t		 outcap;
+};
+
+static int	 ctl_fd = -1;
+
+static struct iolimit	 io_global;
+static struct iolimit	 io_devs[MAX_DEVICES];
+static size_t		 io_ndevs = 0;
+static pthread_mutex_t	 io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * now_ns returns the monotonic clock in nanoseconds, or, when
+ * simulating, the virtual clock. Everything that schedules or measures
+ * goes through it.
+ */
+static uint64_t
+now_ns(void)
+{
+	struct timespec	 ts;
+
+	if (sim) {
+		return sim_clock;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * SEC + (uint64_t)ts.tv_nsec;
+}
+
+
+/*
+ * hash is FNV-1a, which is plenty for spreading monitor keys and
+ * periodic tasks.
+ */
+static uint64_t
+hash(const unsigned char *p, size_t len)
+{
+	uint64_t	 h = 0xcbf29ce484222325ULL;
+
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+
+/*
+ * arena_alloc returns n bytes of scratch memory, good until the next
+ * arena_reset on this thread.
+ */
+static void *
+arena_alloc(size_t n)
+{
+	struct spill	*sp;
+	void		*p;
+
+	n = (n + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+	if (NULL == scratch.base &&
+	    NULL == (scratch.base = malloc(ARENA_SIZE))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+
+	if (n <= ARENA_SIZE - scratch.used) {
+		p = scratch.base + scratch.used;
+		scratch.used += n;
+		return p;
+	}
+
+	if (NULL == (sp = malloc(sizeof(*sp) + n))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	sp->next = scratch.spills;
+	scratch.spills = sp;
+	return sp->data;
+}
+
+
+/*
+ * arena_cat concatenates its arguments, up to a NULL, into scratch
+ * memory. It stands in for asprintf on the hot path, which would drag
+ * in stdio's formatting.
+ */
+static char *
+arena_cat(const char *s, ...)
+{
+	va_list		 ap;
+	const char	*p;
+	char		*buf, *q;
+	size_t		 len = 0;
+
+	va_start(ap, s);
+	for (p = s; NULL != p; p = va_arg(ap, const char *)) {
+		len += strlen(p);
+	}
+	va_end(ap);
+
+	q = buf = arena_alloc(len + 1);
+	va_start(ap, s);
+	for (p = s; NULL != p; p = va_arg(ap, const char *)) {
+		len = strlen(p);
+		memcpy(q, p, len);
+		q += len;
+	}
+	va_end(ap);
+
+	*q = 0;
+	return buf;
+}
+
+
+/*
+ * utoa formats n in decimal into scratch memory.
+ */
+static char *
+utoa(unsigned long n)
+{
+	char	 buf[24];
+	char	*p = buf + sizeof(buf);
+
+	*--p = 0;
+	do {
+		*--p = (char)('0' + n % 10);
+		n /= 10;
+	} while (n > 0);
+
+	return arena_cat(p, NULL);
+}
+
+
+static void
+arena_reset(void)
+{
+	struct spill	*sp;
+
+	while (NULL != (sp = scratch.spills)) {
+		scratch.spills = sp->next;
+		free(sp);
+	}
+	scratch.used = 0;
+}
+
+
+/*
+ * Built with ALLOC_CHECK, for testing against glibc, malloc and friends
+ * are wrapped so the simulator and the benchmarks can count what their
+ * steady state allocates and frees, which should be nothing: the loop
+ * works out of arenas, and out of structures grown to size while
+ * warming up. Other builds use the allocator untouched. The wrappers
+ * clash with libc's own in a static link, so check a dynamic build.
+ */
+#ifdef ALLOC_CHECK
+#ifndef __GLIBC__
+#error "ALLOC_CHECK needs glibc"
+#endif
+
+extern void	*__libc_malloc(size_t);
+extern void	*__libc_calloc(size_t, size_t);
+extern void	*__libc_realloc(void *, size_t);
+extern void	 __libc_free(void *);
+
+static atomic_int	 alloc_counting;
+static atomic_ulong	 nallocs;
+
+
+static void
+alloc_count(void)
+{
+	if (atomic_load_explicit(&alloc_counting, memory_order_relaxed)) {
+		atomic_fetch_add_explicit(&nallocs, 1, memory_order_relaxed);
+	}
+}
+
+
+/*
+ * alloc_start starts counting calls to the allocator, from every
+ * thread, and alloc_stop stops and returns how many there were.
+ */
+static void
+alloc_start(void)
+{
+	atomic_store(&nallocs, 0);
+	atomic_store(&alloc_counting, 1);
+}
+
+
+static unsigned long
+alloc_stop(void)
+{
+	atomic_store(&alloc_counting, 0);
+	return atomic_load(&nallocs);
+}
+
+
+void *
+malloc(size_t n)
+{
+	alloc_count();
+	return __libc_malloc(n);
+}
+
+
+void *
+calloc(size_t n, size_t size)
+{
+	alloc_count();
+	return __libc_calloc(n, size);
+}
+
+
+void *
+realloc(void *p, size_t n)
+{
+	alloc_count();
+	return __libc_realloc(p, n);
+}
+
+
+void
+free(void *p)
+{
+	if (NULL != p) {
+		alloc_count();
+	}
+	__libc_free(p);
+}
+#endif
+
+
+/*
+ * timer_add schedules fn(arg) to run at when.
+ */
+static void
+timer_add(uint64_t when, void (*fn)(void *), void *arg)
+{
+	struct timer	 t;
+	size_t		 i;
+
+	if (ntimers == timercap) {
+		timercap = timercap ? timercap * 2 : 64;
+		timers = reallocarray(timers, timercap, sizeof(*timers));
+		if (NULL == timers) {
+			err(EXIT_FAILURE, "out of memory");
+		}
+	}
+
+	for (i = ntimers++; i > 0 && timers[(i - 1) / 2].when > when;
+	    i = (i - 1) / 2) {
+		timers[i] = timers[(i - 1) / 2];
+	}
+	t.when = when;
+	t.fn = fn;
+	t.arg = arg;
+	timers[i] = t;
+}
+
+
+/*
+ * timer_timeout returns how long, in milliseconds, epoll_wait may block
+ * before the next timer is due, or -1 if there are none.
+ */
+static int
+timer_timeout(void)
+{
+	uint64_t	 now;
+
+	if (0 == ntimers) {
+		return -1;
+	}
+
+	now = now_ns();
+	if (timers[0].when <= now) {
+		return 0;
+	}
+	return (int)((timers[0].when - now + MSEC - 1) / MSEC);
+}
+
+
+/*
+ * timer_run runs every timer that's due. Timers added by the callbacks
+ * run in the same pass if they're already due.
+ */
+static void
+timer_run(void)
+{
+	struct timer	 t, last;
+	uint64_t	 now = now_ns();
+	size_t		 i, c;
+
+	while (ntimers > 0 && timers[0].when <= now) {
+		t = timers[0];
+		last = timers[--ntimers];
+		for (i = 0; (c = 2 * i + 1) < ntimers; i = c) {
+			if (c + 1 < ntimers &&
+			    timers[c + 1].when < timers[c].when) {
+				c++;
+			}
+			if (last.when <= timers[c].when) {
+				break;
+			}
+			timers[i] = timers[c];
+		}
+		timers[i] = last;
+
+		t.fn(t.arg);
+	}
+}
+
+
+/*
+ * periodic_when returns when p's current round runs: at its phase in
+ * the round's slot of the clock, plus that round's jitter. Slots are
+ * aligned to the clock rather than to when p started, so tasks with
+ * the same period keep their spacing however they were started.
+ */
+static uint64_t
+periodic_when(const struct periodic *p)
+{
+	uint64_t	 mix[2], jitter;
+
+	mix[0] = p->key;
+	mix[1] = p->round;
+	jitter = p->period / 100 * PERIODIC_JITTER;
+	return p->round * p->period + p->key % p->period + (jitter ?
+	    hash((const unsigned char *)mix, sizeof(mix)) % jitter : 0);
+}
+
+
+/*
+ * periodic_fire runs p, then schedules its next round, skipping any
+ * that were missed.
+ */
+static void
+periodic_fire(void *arg)
+{
+	struct periodic	*p = arg;
+	uint64_t	 now;
+
+	p->fn(p->arg);
+
+	now = now_ns();
+	for (p->round++; periodic_when(p) <= now; p->round++) {
+		continue;
+	}
+	timer_add(periodic_when(p), periodic_fire, p);
+}
+
+
+/*
+ * periodic_start schedules p's first run: the first round after now,
+ * by which p runs somewhere within a period of starting.
+ */
+static void
+periodic_start(struct periodic *p, const char *name, uint64_t period,
+    void (*fn)(void *), void *arg)
+{
+	uint64_t	 now = now_ns();
+
+	p->name = name;
+	p->period = period;
+	p->fn = fn;
+	p->arg = arg;
+	p->key = hash((const unsigned char *)name, strlen(name));
+	for (p->round = now / period; periodic_when(p) <= now; p->round++) {
+		continue;
+	}
+	timer_add(periodic_when(p), periodic_fire, p);
+}
+
+
+/*
+ * hist_index returns the bucket ns falls in. Values below 2^HIST_BITS
+ * get a bucket each; above that, the bucket is the magnitude and the
+ * top HIST_BITS bits below it.
+ */
+static size_t
+hist_index(uint64_t ns)
+{
+	int	 shift;
+
+	if (ns >> HIST_MAX_BITS) {
+		ns = (1ULL << HIST_MAX_BITS) - 1;
+	}
+	if (ns < (1U << HIST_BITS)) {
+		return (size_t)ns;
+	}
+
+	shift = 63 - __builtin_clzll(ns) - HIST_BITS + 1;
+	return ((size_t)shift << (HIST_BITS - 1)) + (size_t)(ns >> shift);
+}
+
+
+/*
+ * hist_value returns the highest value that falls in bucket i.
+ */
+static uint64_t
+hist_value(size_t i)
+{
+	uint64_t	 mant;
+	int		 shift;
+
+	if (i < (1U << HIST_BITS)) {
+		return i;
+	}
+
+	shift = (int)(i >> (HIST_BITS - 1)) - 1;
+	mant = i - ((size_t)shift << (HIST_BITS - 1));
+	return ((mant + 1) << shift) - 1;
+}
+
+
+/*
+ * hist_record records that op took ns on this thread. The first record
+ * on a thread allocates its shard; if that fails, the record is lost.
+ */
+static void
+hist_record(int op, uint64_t ns)
+{
+	struct shard	*s = shard;
+	uint64_t	 max;
+
+	if (NULL == s) {
+		if (NULL == (s = calloc(1, sizeof(*s)))) {
+			return;
+		}
+		s->next = atomic_load(&shards);
+		while (!atomic_compare_exchange_weak(&shards, &s->next, s)) {
+			continue;
+		}
+		shard = s;
+	}
+
+	atomic_fetch_add_explicit(&s->buckets[op][hist_index(ns)], 1,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&s->sum[op], ns, memory_order_relaxed);
+	max = atomic_load_explicit(&s->max[op], memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak_explicit(&s->max[op],
+	    &max, ns, memory_order_relaxed, memory_order_relaxed)) {
+		continue;
+	}
+}
+
+
+/*
+ * hist_merge drains every thread's shard into hists.
+ */
+static void
+hist_merge(void)
+{
+	struct shard	*s;
+	struct hist	*h;
+	uint64_t	 n;
+	size_t		 i;
+	int		 op;
+
+	for (s = atomic_load(&shards); NULL != s; s = s->next) {
+		for (op = 0; op < NOPS; op++) {
+			h = &hists[op];
+			for (i = 0; i < HIST_BUCKETS; i++) {
+				if (0 == atomic_load_explicit(
+				    &s->buckets[op][i], memory_order_relaxed)) {
+					continue;
+				}
+				n = atomic_exchange_explicit(&s->buckets[op][i],
+				    0, memory_order_relaxed);
+				h->buckets[i] += n;
+				h->count += n;
+			}
+			h->sum += atomic_exchange_explicit(&s->sum[op], 0,
+			    memory_order_relaxed);
+			n = atomic_exchange_explicit(&s->max[op], 0,
+			    memory_order_relaxed);
+			if (n > h->max) {
+				h->max = n;
+			}
+		}
+	}
+}
+
+
+/*
+ * hist_quantile returns the value at quantile q of h.
+ */
+static uint64_t
+hist_quantile(const struct hist *h, double q)
+{
+	uint64_t	 want, seen = 0;
+	size_t		 i;
+
+	if (0 == h->count) {
+		return 0;
+	}
+
+	want = (uint64_t)(q * (double)h->count + 0.5);
+	if (want < 1) {
+		want = 1;
+	}
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= want) {
+			break;
+		}
+	}
+
+	i = hist_value(i);
+	return i < h->max ? i : h->max;
+}
+
+
+/*
+ * hist_tick is the periodic timer for hist_merge.
+ */
+static void
+hist_tick(void *arg)
+{
+	(void)arg;
+
+	hist_merge();
+}
+
+
+/*
+ * pmc_open opens this thread's counters as a group, counting user time
+ * only, which needs no privilege at the default perf_event_paranoid.
+ * It returns the group leader, or -2 if the counters aren't available.
+ */
+static int
+pmc_open(void)
+{
+	static const uint64_t	 configs[NPMC] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES
+	};
+	struct perf_event_attr	 attr;
+	int			 fds[NPMC];
+	int			 i, j;
+
+	for (i = 0; i < NPMC; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[i];
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1,
+		    0 == i ? -1 : fds[0], PERF_FLAG_FD_CLOEXEC);
+		if (-1 == fds[i]) {
+			for (j = 0; j < i; j++) {
+				close(fds[j]);
+			}
+			return -2;
+		}
+	}
+
+	return fds[0];
+}
+
+
+/*
+ * pmc_read reads this thread's counters into pmc, opening them the
+ * first time. It returns 0 if profiling is off or the counters can't
+ * be read.
+ */
+static int
+pmc_read(uint64_t *pmc)
+{
+	struct {
+		uint64_t	 nr;
+		uint64_t	 values[NPMC];
+	}			 buf;
+
+	if (!atomic_load_explicit(&profile_on, memory_order_relaxed)) {
+		return 0;
+	}
+	if (-1 == pmc_fd) {
+		pmc_fd = pmc_open();
+	}
+	if (pmc_fd < 0 ||
+	    (ssize_t)sizeof(buf) != read(pmc_fd, &buf, sizeof(buf))) {
+		return 0;
+	}
+
+	memcpy(pmc, buf.values, sizeof(buf.values));
+	return 1;
+}
+
+
+/*
+ * sample_begin starts measuring from now.
+ */
+static void
+sample_begin(struct sample *s)
+{
+	s->counted = pmc_read(s->pmc);
+	s->ns = now_ns();
+}
+
+
+/*
+ * sample_delta sets pmc to the counts since s, if they were read then
+ * and now.
+ */
+static int
+sample_delta(const struct sample *s, uint64_t *pmc)
+{
+	int	 i;
+
+	if (!s->counted || !pmc_read(pmc)) {
+		return 0;
+	}
+	for (i = 0; i < NPMC; i++) {
+		pmc[i] -= s->pmc[i];
+	}
+	return 1;
+}
+
+
+/*
+ * trace_span records that name ran from start to end on this thread,
+ * if tracing is on. arg, if set, must outlive the trace.
+ */
+static void
+trace_span(const char *name, uint64_t start, uint64_t end, const char *arg)
+{
+	struct tracebuf	*b = tracebuf;
+	struct span	*sp;
+	uint64_t	 i;
+
+	if (!atomic_load_explicit(&trace_on, memory_order_relaxed)) {
+		return;
+	}
+
+	if (NULL == b) {
+		if (NULL == (b = calloc(1, sizeof(*b)))) {
+			return;
+		}
+		b->tid = NULL == self ? 0 : 1 + (long)(self - workers);
+		b->next = atomic_load(&tracebufs);
+		while (!atomic_compare_exchange_weak(&tracebufs, &b->next, b)) {
+			continue;
+		}
+		tracebuf = b;
+	}
+
+	i = atomic_load_explicit(&b->head, memory_order_relaxed);
+	sp = &b->spans[i % TRACE_EVENTS];
+	atomic_store_explicit(&sp->seq, 2 * i + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	sp->name = name;
+	sp->arg = arg;
+	sp->start = start;
+	sp->end = end;
+	atomic_store_explicit(&sp->seq, 2 * i + 2, memory_order_release);
+	atomic_store_explicit(&b->head, i + 1, memory_order_release);
+}
+
+
+/*
+ * op_done records an op that began at start, in its histogram and in
+ * the trace, and returns how long it took.
+ */
+static uint64_t
+op_done(int op, uint64_t start, const char *arg)
+{
+	uint64_t	 end = now_ns();
+
+	hist_record(op, end - start);
+	trace_span(op_names[op], start, end, arg);
+	return end - start;
+}
+
+
+static int
+deque_push(struct worker *w, struct job *j)
+{
+	long	 b = atomic_load(&w->bottom);
+
+	if (b - atomic_load(&w->top) >= DEQUE_SIZE) {
+		return -1;
+	}
+	atomic_store(&w->buf[b & (DEQUE_SIZE - 1)], j);
+	atomic_store(&w->bottom, b + 1);
+	return 0;
+}
+
+
+static struct job *
+deque_pop(struct worker *w)
+{
+	struct job	*j;
+	long		 b, t;
+
+	b = atomic_load(&w->bottom) - 1;
+	atomic_store(&w->bottom, b);
+	t = atomic_load(&w->top);
+
+	if (t > b) {
+		atomic_store(&w->bottom, b + 1);
+		return NULL;
+	}
+
+	j = atomic_load(&w->buf[b & (DEQUE_SIZE - 1)]);
+	if (t == b) {
+		/* Last one: race any thieves for it. */
+		if (!atomic_compare_exchange_strong(&w->top, &t, t + 1)) {
+			j = NULL;
+		}
+		atomic_store(&w->bottom, b + 1);
+	}
+	return j;
+}
+
+
+static struct job *
+deque_steal(struct worker *w)
+{
+	struct job	*j;
+	long		 t, b;
+
+	t = atomic_load(&w->top);
+	b = atomic_load(&w->bottom);
+	if (t >= b) {
+		return NULL;
+	}
+
+	j = atomic_load(&w->buf[t & (DEQUE_SIZE - 1)]);
+	if (!atomic_compare_exchange_strong(&w->top, &t, t + 1)) {
+		return NULL;
+	}
+	return j;
+}
+
+
+static int
+inject_push(struct job *j)
+{
+	struct ring	*r = &inject[j->class];
+	struct slot	*s;
+	size_t		 pos, seq;
+
+	pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	for (;;) {
+		s = &r->slots[pos & (POOL_QUEUE - 1)];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq == pos) {
+			if (atomic_compare_exchange_weak(&r->tail, &pos,
+			    pos + 1)) {
+				break;
+			}
+		} else if ((intptr_t)(seq - pos) < 0) {
+			return -1;
+		} else {
+			pos = atomic_load(&r->tail);
+		}
+	}
+
+	s->job = j;
+	atomic_store_explicit(&s->seq, pos + 1, memory_order_release);
+	return 0;
+}
+
+
+static struct job *
+inject_pop(int class)
+{
+	struct ring	*r = &inject[class];
+	struct slot	*s;
+	struct job	*j;
+	size_t		 pos, seq;
+
+	pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+	for (;;) {
+		s = &r->slots[pos & (POOL_QUEUE - 1)];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq == pos + 1) {
+			if (atomic_compare_exchange_weak(&r->head, &pos,
+			    pos + 1)) {
+				break;
+			}
+		} else if ((intptr_t)(seq - (pos + 1)) < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load(&r->head);
+		}
+	}
+
+	j = s->job;
+	atomic_store_explicit(&s->seq, pos + POOL_QUEUE, memory_order_release);
+	return j;
+}
+
+
+/*
+ * pool_take finds the next job for a worker: restart-path work first,
+ * then its own deque (follow-on work for whatever it was doing), then
+ * the other injection queues in class order, then whatever it can
+ * steal. While the pool is paused, only restart-path work and probes
+ * are taken.
+ */
+static struct job *
+pool_take(struct worker *w)
+{
+	struct job	*j;
+	long		 i, start;
+	int		 class;
+
+	if (NULL != (j = inject_pop(JOB_RESTART))) {
+		return j;
+	}
+	if (atomic_load(&pool_paused)) {
+		return inject_pop(JOB_PROBE);
+	}
+	if (NULL != (j = deque_pop(w))) {
+		return j;
+	}
+	for (class = JOB_RESTART + 1; class < NJOBCLASS; class++) {
+		if (NULL != (j = inject_pop(class))) {
+			return j;
+		}
+	}
+
+	start = w - workers;
+	for (i = 1; i < nworkers; i++) {
+		j = deque_steal(&workers[(start + i) % nworkers]);
+		if (NULL != j) {
+			return j;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * pool_run runs j, and hands it back to the event loop if it wants to
+ * hear about it. Once j has been handed back or marked finished it may
+ * be freed under us, so nothing after that looks at it.
+ */
+static void
+pool_run(struct job *j)
+{
+	struct sample	 smp;
+	void		(*done)(struct job *) = j->done;
+	atomic_long	*finished = j->finished;
+	uint64_t	 one = 1, pmc[NPMC];
+	int		 prev = running, class = j->class, i;
+
+	atomic_fetch_sub(&pool_queued, 1);
+	running = class;
+	depth++;
+	sample_begin(&smp);
+	j->fn(j);
+	trace_span(class_names[class], smp.ns, now_ns(), NULL);
+	if (sample_delta(&smp, pmc)) {
+		/* A job run inside this one is counted in both. */
+		atomic_fetch_add_explicit(&job_pruns[class], 1,
+		    memory_order_relaxed);
+		for (i = 0; i < NPMC; i++) {
+			atomic_fetch_add_explicit(&job_pmc[class][i], pmc[i],
+			    memory_order_relaxed);
+		}
+	}
+	running = prev;
+
+	/* Jobs run from inside other jobs share the outer one's scratch. */
+	if (0 == --depth) {
+		arena_reset();
+	}
+
+	if (NULL != done) {
+		j->next = atomic_load(&pool_done);
+		while (!atomic_compare_exchange_weak(&pool_done, &j->next, j))
+			;
+		write(pool_efd, &one, sizeof(one));
+	}
+	if (NULL != finished) {
+		atomic_fetch_sub(finished, 1);
+	}
+}
+
+
+/*
+ * pool_urgent says whether any restart-path work or probes are queued,
+ * which is all a paused worker will take.
+ */
+static int
+pool_urgent(void)
+{
+	int	 class;
+
+	for (class = JOB_RESTART; class <= JOB_PROBE; class++) {
+		if (atomic_load(&inject[class].head) !=
+		    atomic_load(&inject[class].tail)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static void *
+pool_worker(void *arg)
+{
+	struct job	*j;
+
+	self = arg;
+	for (;;) {
+		if (NULL != (j = pool_take(self))) {
+			pool_run(j);
+			continue;
+		}
+
+		/*
+		 * Sleepers are counted before the queue is rechecked, so a
+		 * submitter either sees the sleeper or this sees the job.
+		 */
+		pthread_mutex_lock(&pool_lock);
+		atomic_fetch_add(&pool_sleepers, 1);
+		while (0 == atomic_load(&pool_queued) ||
+		    (atomic_load(&pool_paused) && !pool_urgent())) {
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		}
+		atomic_fetch_sub(&pool_sleepers, 1);
+		pthread_mutex_unlock(&pool_lock);
+	}
+	return NULL;
+}
+
+
+/*
+ * pool_submit queues j. From a worker it goes on that worker's deque;
+ * from anywhere else it goes through the injection queue, and if that
+ * is full, onto a backlog that pool_flush feeds in as room appears.
+ */
+static void
+pool_submit(struct job *j)
+{
+	/* Restart-path work never sits behind a busy worker's deque. */
+	if (NULL != self && JOB_RESTART != j->class &&
+	    0 == deque_push(self, j)) {
+		goto queued;
+	}
+	if (NULL == backlog[j->class] && 0 == inject_push(j)) {
+		goto queued;
+	}
+
+	if (NULL != self) {
+		/* The worker's own deque is full; just do it now. */
+		atomic_fetch_add(&pool_queued, 1);
+		pool_run(j);
+		return;
+	}
+
+	j->next = NULL;
+	if (NULL == backlog[j->class]) {
+		backlog[j->class] = j;
+	} else {
+		backlog_tail[j->class]->next = j;
+	}
+	backlog_tail[j->class] = j;
+	return;
+
+queued:
+	atomic_fetch_add(&pool_queued, 1);
+	if (atomic_load(&pool_sleepers) > 0) {
+		pthread_mutex_lock(&pool_lock);
+		pthread_cond_signal(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+
+/*
+ * pool_flush moves as much of the backlog into the injection queue as
+ * will fit.
+ */
+static void
+pool_flush(void)
+{
+	struct job	*j;
+	int		 class, n = 0;
+
+	for (class = 0; class < NJOBCLASS; class++) {
+		while (NULL != (j = backlog[class]) && 0 == inject_push(j)) {
+			backlog[class] = j->next;
+			atomic_fetch_add(&pool_queued, 1);
+			n++;
+		}
+	}
+
+	if (n > 0) {
+		pthread_mutex_lock(&pool_lock);
+		pthread_cond_broadcast(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+
+/*
+ * pool_preempt is called by bulk jobs between chunks. If restart-path
+ * work has come in, it's run right here, ahead of the rest of the
+ * chunks. While the pool is paused, the bulk job waits here, still
+ * running restart-path work and probes as they arrive: with every
+ * worker parked like this, there's nowhere else for them to run.
+ */
+static void
+pool_preempt(void)
+{
+	struct timespec	 ts = {0, PSI_POLL_MS * MSEC};
+	struct job	*j;
+
+	if (NULL == self || JOB_RESTART == running) {
+		return;
+	}
+	for (;;) {
+		while (NULL != (j = inject_pop(JOB_RESTART))) {
+			pool_run(j);
+		}
+		if (JOB_PROBE == running || !atomic_load(&pool_paused)) {
+			break;
+		}
+		if (NULL != (j = inject_pop(JOB_PROBE))) {
+			pool_run(j);
+			continue;
+		}
+		nanosleep(&ts, NULL);
+	}
+}
+
+
+/*
+ * pool_pause pauses or resumes everything but restart-path work and
+ * probes.
+ */
+static void
+pool_pause(int paused)
+{
+	atomic_store(&pool_paused, paused);
+	if (!paused) {
+		pthread_mutex_lock(&pool_lock);
+		pthread_cond_broadcast(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+
+/*
+ * pool_help runs queued jobs on the calling thread until done drops to
+ * zero. A worker waiting on its own follow-on jobs uses this to run any
+ * that haven't been stolen, so it can't deadlock on them. Restart-path
+ * follow-ons skip the deque for the injection queue, so that's drained
+ * too, or a critical job would spin until another worker came free.
+ */
+static void
+pool_help(atomic_long *done)
+{
+	struct job	*j;
+
+	while (atomic_load(done) > 0) {
+		if (NULL != self && (NULL != (j = deque_pop(self)) ||
+		    NULL != (j = inject_pop(running)))) {
+			pool_run(j);
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+
+/*
+ * pool_reap runs on the event loop thread, calling done for each job
+ * the workers have finished.
+ */
+static void
+pool_reap(struct handler *h)
+{
+	struct job	*j, *next, *list = NULL;
+	uint64_t	 n;
+
+	read(h->fd, &n, sizeof(n));
+
+	/* Finished jobs are stacked; put them back in order. */
+	for (j = atomic_exchange(&pool_done, NULL); NULL != j; j = next) {
+		next = j->next;
+		j->next = list;
+		list = j;
+	}
+	for (j = list; NULL != j; j = next) {
+		next = j->next;
+		j->done(j);
+	}
+
+	pool_flush();
+}
+
+
+/*
+ * pool_init starts n workers, or one per online CPU if n is 0.
+ */
+static void
+pool_init(long n)
+{
+	pthread_attr_t	 attr;
+	size_t		 i;
+	int		 class;
+
+	if (n <= 0 && (n = sysconf(_SC_NPROCESSORS_ONLN)) <= 0) {
+		n = 1;
+	}
+
+	for (class = 0; class < NJOBCLASS; class++) {
+		for (i = 0; i < POOL_QUEUE; i++) {
+			atomic_init(&inject[class].slots[i].seq, i);
+		}
+	}
+
+	if (-1 == (pool_efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC))) {
+		err(EXIT_FAILURE, "couldn't start the job pool");
+	}
+
+	if (NULL == (workers = calloc((size_t)n, sizeof(*workers)))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+
+	pthread_attr_init(&attr);
+	if (POOL_STACK > 0) {
+		pthread_attr_setstacksize(&attr, POOL_STACK);
+	}
+	for (nworkers = 0; nworkers < n; nworkers++) {
+		if (0 != pthread_create(&workers[nworkers].tid, &attr,
+		    pool_worker, &workers[nworkers])) {
+			err(EXIT_FAILURE, "couldn't start the job pool");
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+
+/*
+ * add_artifact registers path to be kept in place, restoring it from
+ * src if it goes missing.
+ */
+static void
+add_artifact(const char *path, int src, int critical)
+{
+	struct artifact	*a;
+	struct stat	 st;
+
+	if (-1 == fstat(src, &st)) {
+		warn("couldn't stat %s", path);
+		close(src);
+		return;
+	}
+
+	a = reallocarray(artifacts, nartifacts + 1, sizeof(*artifacts));
+	if (NULL == a) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	artifacts = a;
+
+	a = &artifacts[nartifacts++];
+	memset(a, 0, sizeof(*a));
+	a->path = strdup(path);
+	a->src = src;
+	a->dev = st.st_dev;
+	a->mode = st.st_mode & 07777;
+	a->critical = critical;
+}
+
+
+/*
+ * raise_nofile lifts the open file limit as far as it goes: each
+ * artifact holds its original open, and each service a pidfd.
+ */
+static void
+raise_nofile(void)
+{
+	struct rlimit	 rl;
+
+	if (0 == getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+}
+
+
+/*
+ * svc_add registers a service named name, run as argv.
+ */
+static struct service *
+svc_add(const char *name, char **argv)
+{
+	struct service	**sv, *s;
+	size_t		  argc, i;
+
+	sv = reallocarray(services, nservices + 1, sizeof(*services));
+	if (NULL == sv || NULL == (s = calloc(1, sizeof(*s)))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	services = sv;
+
+	for (argc = 0; NULL != argv[argc]; argc++) {
+		continue;
+	}
+	if (NULL == (s->argv = calloc(argc + 1, sizeof(*s->argv)))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	for (i = 0; i < argc; i++) {
+		if (NULL == (s->argv[i] = strdup(argv[i]))) {
+			err(EXIT_FAILURE, "out of memory");
+		}
+	}
+	if (NULL == (s->name = strdup(name))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+
+	s->h.fd = -1;
+	s->cg = -1;
+	s->stop_signal = SIGTERM;
+	s->stop_timeout = SVC_STOP_TIMEOUT * SEC;
+	s->idx = nservices;
+	services[nservices++] = s;
+	return s;
+}
+
+
+/*
+ * signum returns the signal called name, with or without "SIG", or
+ * numbered name, or -1.
+ */
+static int
+signum(const char *name)
+{
+	static const struct {
+		const char	*name;
+		int		 sig;
+	} sigs[] = {
+		{"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT},
+		{"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+		{"TERM", SIGTERM}, {"WINCH", SIGWINCH}
+	};
+	size_t	 i;
+	int	 n;
+
+	if (0 == strncmp(name, "SIG", 3)) {
+		name += 3;
+	}
+	for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+		if (0 == strcmp(name, sigs[i].name)) {
+			return sigs[i].sig;
+		}
+	}
+	n = atoi(name);
+	return n > 0 && n < NSIG ? n : -1;
+}
+
+
+/*
+ * svc_option applies a manifest option to s. It returns -1 if opt isn't
+ * one.
+ */
+static int
+svc_option(struct service *s, const char *opt)
+{
+	char	*names, *name, *last;
+
+	if (0 == strcmp(opt, "critical")) {
+		s->critical = 1;
+		return 0;
+	}
+	if (0 == strncmp(opt, "priority=", 9)) {
+		s->priority = atoi(opt + 9);
+		return 0;
+	}
+	if (0 == strncmp(opt, "stop=", 5)) {
+		return -1 == (s->stop_signal = signum(opt + 5)) ? -1 : 0;
+	}
+	if (0 == strncmp(opt, "stop-timeout=", 13)) {
+		s->stop_timeout = (uint64_t)(atof(opt + 13) * SEC);
+		return 0;
+	}
+	if (0 != strncmp(opt, "after=", 6)) {
+		return -1;
+	}
+
+	if (NULL == (names = strdup(opt + 6))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	for (name = strtok_r(names, ",", &last); NULL != name;
+	    name = strtok_r(NULL, ",", &last)) {
+		s->after_names = reallocarray(s->after_names,
+		    s->nafter_names + 1, sizeof(*s->after_names));
+		if (NULL == s->after_names || NULL ==
+		    (s->after_names[s->nafter_names++] = strdup(name))) {
+			err(EXIT_FAILURE, "out of memory");
+		}
+	}
+	free(names);
+	return 0;
+}
+
+
+/*
+ * strdupv copies a NULL-terminated array of strings.
+ */
+static char **
+strdupv(char **v, size_t n)
+{
+	char	**c;
+	size_t	  i;
+
+	if (NULL == (c = calloc(n + 1, sizeof(*c)))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	for (i = 0; i < n; i++) {
+		if (NULL == (c[i] = strdup(v[i]))) {
+			err(EXIT_FAILURE, "out of memory");
+		}
+	}
+	return c;
+}
+
+
+/*
+ * tmpl_find returns the template called name, or NULL.
+ */
+static struct template *
+tmpl_find(const char *name)
+{
+	size_t	 i;
+
+	for (i = 0; i < ntemplates; i++) {
+		if (0 == strcmp(templates[i]->name, name)) {
+			return templates[i];
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * tmpl_grow makes t's next instance, retired until it's wanted.
+ */
+static struct service *
+tmpl_grow(struct template *t)
+{
+	struct service	 *s, **inst;
+	char		 *argv[SVC_MAX_ARGS + 1], *num, *pct;
+	size_t		  i;
+	int		  o;
+
+	num = arena_cat(utoa(t->ninst), NULL);
+	for (i = 0; NULL != t->argv[i]; i++) {
+		argv[i] = t->argv[i];
+		while (NULL != (pct = strstr(argv[i], "%i"))) {
+			*pct = 0;
+			argv[i] = arena_cat(argv[i], num, pct + 2, NULL);
+			*pct = '%';
+		}
+	}
+	argv[i] = NULL;
+
+	s = svc_add(arena_cat(t->name, "@", num, NULL), argv);
+	for (o = 0; o < t->nopts; o++) {
+		svc_option(s, t->opts[o]);
+	}
+	s->tmpl = t;
+	s->retired = 1;
+
+	inst = reallocarray(t->inst, t->ninst + 1, sizeof(*t->inst));
+	if (NULL == inst) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	t->inst = inst;
+	t->inst[t->ninst++] = s;
+	return s;
+}
+
+
+/*
+ * svc_define registers a service from a manifest line: its name, its
+ * argv, and its options. It returns an option it can't take, or NULL.
+ */
+static const char *
+svc_define(const char *name, char **argv, char **opts, int nopts)
+{
+	struct template	**tv, *t;
+	struct service	 *s, check;
+	const char	 *scaling = NULL, *inst = NULL;
+	size_t		  argc, i;
+	long		  n = -1, min = 1, max = -1;
+	double		  target = 0;
+	int		  o, by_queue = 0;
+
+	memset(&check, 0, sizeof(check));
+	for (o = 0; o < nopts; o++) {
+		if (0 == strncmp(opts[o], "instances=", 10)) {
+			n = atol((inst = opts[o]) + 10);
+		} else if (0 == strncmp(opts[o], "min=", 4)) {
+			min = atol((scaling = opts[o]) + 4);
+		} else if (0 == strncmp(opts[o], "max=", 4)) {
+			max = atol((scaling = opts[o]) + 4);
+		} else if (0 == strncmp(opts[o], "target=", 7)) {
+			target = atof((scaling = opts[o]) + 7);
+		} else if (0 == strcmp(opts[o], "scale-on=cpu") ||
+		    0 == strcmp(opts[o], "scale-on=queue")) {
+			by_queue = 'q' == (scaling = opts[o])[9];
+		} else if (-1 == svc_option(&check, opts[o])) {
+			return opts[o];
+		}
+	}
+	for (i = 0; i < check.nafter_names; i++) {
+		free(check.after_names[i]);
+	}
+	free(check.after_names);
+
+	if (n > TMPL_MAX_INSTANCES) {
+		return inst;
+	}
+	if (NULL != scaling && (n < 0 || min < 1 || max < min ||
+	    max > TMPL_MAX_INSTANCES || target < 0)) {
+		return scaling;
+	}
+	if (n < 0) {
+		s = svc_add(name, argv);
+		for (o = 0; o < nopts; o++) {
+			svc_option(s, opts[o]);
+		}
+		return NULL;
+	}
+
+	for (argc = 0; NULL != argv[argc]; argc++) {
+		continue;
+	}
+	tv = reallocarray(templates, ntemplates + 1, sizeof(*templates));
+	if (NULL == tv || NULL == (t = calloc(1, sizeof(*t))) ||
+	    NULL == (t->name = strdup(name))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	templates = tv;
+	templates[ntemplates++] = t;
+	t->argv = strdupv(argv, argc);
+	t->opts = strdupv(opts, (size_t)nopts);
+	t->nopts = nopts;
+	if (NULL == scaling) {
+		min = max = n;
+	}
+	t->min = (size_t)min;
+	t->max = (size_t)max;
+	t->want = (size_t)(n < min ? min : n > max ? max : n);
+	t->by_queue = by_queue;
+	t->target = target > 0 ? target :
+	    by_queue ? AUTOSCALE_QUEUE : AUTOSCALE_CPU;
+	while (t->ninst < t->want) {
+		tmpl_grow(t)->retired = 0;
+	}
+	return NULL;
+}
+
+
+/*
+ * load_manifest registers each artifact named in MANIFEST. Every one
+ * of them holds a descriptor, so the open file limit is raised to the
+ * hard limit first.
+ */
+static void
+load_manifest(void)
+{
+	FILE		*mf;
+	const char	*bad;
+	char		*line = NULL;
+	char		*path, *flag, *tok;
+	char		*argv[SVC_MAX_ARGS + 1], *opts[SVC_MAX_OPTS];
+	size_t		 linecap = 0;
+	int		 src, argc, nopts;
+
+	raise_nofile();
+
+	if (NULL == (mf = fopen(MANIFEST, "r"))) {
+		return;
+	}
+
+	while (-1 != getline(&line, &linecap, mf)) {
+		path = strtok(line, " \t\n");
+		if (NULL == path || '#' == path[0]) {
+			continue;
+		}
+		flag = strtok(NULL, " \t\n");
+
+		if (0 == strcmp(path, "service")) {
+			argc = nopts = 0;
+			while (argc < SVC_MAX_ARGS &&
+			    NULL != (tok = strtok(NULL, " \t\n"))) {
+				if (0 == argc && nopts < SVC_MAX_OPTS &&
+				    '/' != tok[0] &&
+				    (NULL != strchr(tok, '=') ||
+				    0 == strcmp(tok, "critical"))) {
+					opts[nopts++] = tok;
+				} else {
+					argv[argc++] = tok;
+				}
+			}
+			argv[argc] = NULL;
+			if (NULL == flag || 0 == argc) {
+				warnx("%s: service needs a name and a path",
+				    MANIFEST);
+				continue;
+			}
+			if (NULL != (bad = svc_define(flag, argv, opts,
+			    nopts))) {
+				warnx("%s: %s: unknown option %s", MANIFEST,
+				    flag, bad);
+			}
+			continue;
+		}
+
+		if (-1 == (src = open(path, O_RDONLY|O_CLOEXEC))) {
+			warn("couldn't open %s", path);
+			continue;
+		}
+		add_artifact(path, src, NULL != flag &&
+		    0 == strcmp(flag, "critical"));
+	}
+
+	free(line);
+	fclose(mf);
+}
+
+
+static void
+bucket_init(struct bucket *b, double rate)
+{
+	b->rate = rate;
+	b->burst = rate;
+	b->tokens = rate;
+	clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+
+static void
+iolimit_init(struct iolimit *l, dev_t dev, double bps, double iops)
+{
+	l->dev = dev;
+	bucket_init(&l->bytes, bps);
+	bucket_init(&l->ops, iops);
+}
+
+
+/*
+ * bucket_wait refills b and returns how many seconds it would take to
+ * cover n tokens; 0 means they are available now.
+ */
+static double
+bucket_wait(struct bucket *b, double n)
+{
+	struct timespec	 now;
+	double		 elapsed;
+
+	if (0 == b->rate) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (double)(now.tv_sec - b->last.tv_sec) +
+	    (double)(now.tv_nsec - b->last.tv_nsec) / 1e9;
+	b->last = now;
+
+	b->tokens += elapsed * b->rate;
+	if (b->tokens > b->burst) {
+		b->tokens = b->burst;
+	}
+
+	/* Requests larger than the burst only need a full bucket. */
+	if (n > b->burst) {
+		n = b->burst;
+	}
+
+	if (b->tokens >= n) {
+		return 0;
+	}
+	return (n - b->tokens) / b->rate;
+}
+
+
+static struct iolimit *
+iolimit_dev(dev_t dev)
+{
+	size_t	 i;
+
+	for (i = 0; i < io_ndevs; i++) {
+		if (io_devs[i].dev == dev) {
+			return &io_devs[i];
+		}
+	}
+
+	/* Past MAX_DEVICES, everything else shares the last slot. */
+	if (MAX_DEVICES == io_ndevs) {
+		return &io_devs[MAX_DEVICES - 1];
+	}
+
+	iolimit_init(&io_devs[io_ndevs], dev, IO_DEV_BPS, IO_DEV_IOPS);
+	return &io_devs[io_ndevs++];
+}
+
+
+/*
+ * throttle blocks until bytes and one operation can be charged against
+ * both the global and dev's buckets. critical I/O never waits; it is
+ * charged anyway, so bulk I/O behind it backs off instead. It's safe to
+ * call from hashing threads.
+ */
+static void
+throttle(dev_t dev, size_t bytes, int critical)
+{
+	struct iolimit	*lims[2];
+	struct timespec	 ts;
+	double		 wait, w;
+	size_t		 i;
+
+	pthread_mutex_lock(&io_lock);
+	lims[0] = &io_global;
+	lims[1] = iolimit_dev(dev);
+	for (;;) {
+		wait = 0;
+		for (i = 0; i < 2; i++) {
+			if ((w = bucket_wait(&lims[i]->bytes, bytes)) > wait) {
+				wait = w;
+			}
+			if ((w = bucket_wait(&lims[i]->ops, 1)) > wait) {
+				wait = w;
+			}
+		}
+
+		if (critical || 0 == wait) {
+			break;
+		}
+
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - (double)ts.tv_sec) * 1e9);
+		pthread_mutex_unlock(&io_lock);
+		nanosleep(&ts, NULL);
+		pthread_mutex_lock(&io_lock);
+	}
+
+	for (i = 0; i < 2; i++) {
+		lims[i]->bytes.tokens -= (double)bytes;
+		lims[i]->ops.tokens -= 1;
+	}
+	pthread_mutex_unlock(&io_lock);
+}
+
+
+/*
+ * BLAKE2s-256, per RFC 7693.
+ */
+struct blake2s {
+	uint32_t	 h[8];
+	uint32_t	 t[2];
+	uint32_t	 f[2];
+	unsigned char	 buf[64];
+	size_t		 buflen;
+};
+
+static const uint32_t	 blake2s_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const unsigned char	 blake2s_sigma[10][16] = {
+	{ 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15},
+	{14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3},
+	{11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4},
+	{ 7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8},
+	{ 9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13},
+	{ 2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9},
+	{12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11},
+	{13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10},
+	{ 6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5},
+	{10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0}
+};
+
+#define ROTR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define B2S_G(a, b, c, d, x, y) do {			\
+	a = a + b + (x); d = ROTR32(d ^ a, 16);		\
+	c = c + d;       b = ROTR32(b ^ c, 12);		\
+	a = a + b + (y); d = ROTR32(d ^ a, 8);		\
+	c = c + d;       b = ROTR32(b ^ c, 7);		\
+} while (0)
+
+
+static uint32_t
+load32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+	    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+static void
+blake2s_compress(struct blake2s *S, const unsigned char *block)
+{
+	const unsigned char	*s;
+	uint32_t		 m[16], v[16];
+	int			 i;
+
+	for (i = 0; i < 16; i++) {
+		m[i] = load32(block + 4 * i);
+	}
+	for (i = 0; i < 8; i++) {
+		v[i] = S->h[i];
+		v[i + 8] = blake2s_iv[i];
+	}
+	v[12] ^= S->t[0];
+	v[13] ^= S->t[1];
+	v[14] ^= S->f[0];
+	v[15] ^= S->f[1];
+
+	for (i = 0; i < 10; i++) {
+		s = blake2s_sigma[i];
+		B2S_G(v[0], v[4], v[ 8], v[12], m[s[ 0]], m[s[ 1]]);
+		B2S_G(v[1], v[5], v[ 9], v[13], m[s[ 2]], m[s[ 3]]);
+		B2S_G(v[2], v[6], v[10], v[14], m[s[ 4]], m[s[ 5]]);
+		B2S_G(v[3], v[7], v[11], v[15], m[s[ 6]], m[s[ 7]]);
+		B2S_G(v[0], v[5], v[10], v[15], m[s[ 8]], m[s[ 9]]);
+		B2S_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+		B2S_G(v[2], v[7], v[ 8], v[13], m[s[12]], m[s[13]]);
+		B2S_G(v[3], v[4], v[ 9], v[14], m[s[14]], m[s[15]]);
+	}
+
+	for (i = 0; i < 8; i++) {
+		S->h[i] ^= v[i] ^ v[i + 8];
+	}
+}
+
+
+static void
+blake2s_update(struct blake2s *S, const unsigned char *p, size_t len)
+{
+	size_t	 n;
+
+	while (len > 0) {
+		/* The last block is held back for blake2s_final. */
+		if (64 == S->buflen) {
+			S->t[0] += 64;
+			if (S->t[0] < 64) {
+				S->t[1]++;
+			}
+			blake2s_compress(S, S->buf);
+			S->buflen = 0;
+		}
+
+		n = 64 - S->buflen;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(S->buf + S->buflen, p, n);
+		S->buflen += n;
+		p += n;
+		len -= n;
+	}
+}
+
+
+static void
+blake2s_final(struct blake2s *S, unsigned char *out)
+{
+	int	 i;
+
+	S->t[0] += (uint32_t)S->buflen;
+	if (S->t[0] < S->buflen) {
+		S->t[1]++;
+	}
+	S->f[0] = 0xffffffff;
+	memset(S->buf + S->buflen, 0, 64 - S->buflen);
+	blake2s_compress(S, S->buf);
+
+	for (i = 0; i < 8; i++) {
+		out[4 * i + 0] = (unsigned char)(S->h[i]);
+		out[4 * i + 1] = (unsigned char)(S->h[i] >> 8);
+		out[4 * i + 2] = (unsigned char)(S->h[i] >> 16);
+		out[4 * i + 3] = (unsigned char)(S->h[i] >> 24);
+	}
+}
+
+
+static void
+ident_statx(struct ident *id, const struct statx *stx)
+{
+	memset(id, 0, sizeof(*id));
+	id->dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	id->ino = stx->stx_ino;
+	id->size = stx->stx_size;
+	id->mtime = (int64_t)stx->stx_mtime.tv_sec * (int64_t)SEC +
+	    stx->stx_mtime.tv_nsec;
+	id->ctime = (int64_t)stx->stx_ctime.tv_sec * (int64_t)SEC +
+	    stx->stx_ctime.tv_nsec;
+}
+
+
+static size_t
+cache_slot(const struct ident *id)
+{
+	uint64_t	 k[2] = {id->dev, id->ino};
+
+	return hash((const unsigned char *)k, sizeof(k)) & (cache->nslots - 1);
+}
+
+
+/*
+ * cache_map (re)maps the cache file at nslots entries. With reset, the
+ * file is cleared first.
+ */
+static int
+cache_map(uint64_t nslots, int reset)
+{
+	size_t	 len = sizeof(*cache) + nslots * sizeof(*cache_ents);
+
+	if (NULL != cache) {
+		munmap(cache, sizeof(*cache) + cache->nslots *
+		    sizeof(*cache_ents));
+		cache = NULL;
+	}
+
+	if ((reset && -1 == ftruncate(cache_fd, 0)) ||
+	    -1 == ftruncate(cache_fd, (off_t)len)) {
+		return -1;
+	}
+
+	cache = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, cache_fd, 0);
+	if (MAP_FAILED == cache) {
+		cache = NULL;
+		return -1;
+	}
+	cache_ents = (struct cache_ent *)(cache + 1);
+
+	if (reset) {
+		cache->magic = CACHE_MAGIC;
+		cache->version = CACHE_VERSION;
+		cache->nslots = nslots;
+		cache->nused = 0;
+	}
+	return 0;
+}
+
+
+/*
+ * cache_open maps DIGEST_CACHE, starting it afresh if it's missing or
+ * doesn't look right. Without it, everything is hashed.
+ */
+static void
+cache_open(void)
+{
+	struct cache_hdr	 hdr;
+	struct stat		 st;
+
+	if (-1 == (cache_fd = open(DIGEST_CACHE, O_RDWR|O_CREAT|O_CLOEXEC,
+	    0600))) {
+		return;
+	}
+
+	if (0 == fstat(cache_fd, &st) && (size_t)st.st_size >= sizeof(hdr) &&
+	    sizeof(hdr) == pread(cache_fd, &hdr, sizeof(hdr), 0) &&
+	    CACHE_MAGIC == hdr.magic && CACHE_VERSION == hdr.version &&
+	    0 != hdr.nslots && 0 == (hdr.nslots & (hdr.nslots - 1)) &&
+	    (uint64_t)st.st_size == sizeof(hdr) + hdr.nslots *
+	    sizeof(struct cache_ent) && 0 == cache_map(hdr.nslots, 0)) {
+		return;
+	}
+
+	if (-1 == cache_map(CACHE_SLOTS, 1)) {
+		warn("couldn't set up %s", DIGEST_CACHE);
+		close(cache_fd);
+		cache_fd = -1;
+	}
+}
+
+
+static int
+cache_get(const struct ident *id, unsigned char *digest)
+{
+	struct cache_ent	*e;
+	size_t			 i;
+	int			 rv = -1;
+
+	pthread_mutex_lock(&cache_lock);
+	if (NULL == cache) {
+		goto fin;
+	}
+
+	for (i = cache_slot(id); 0 != cache_ents[i].id.ino;
+	    i = (i + 1) & (cache->nslots - 1)) {
+		e = &cache_ents[i];
+		if (e->id.dev == id->dev && e->id.ino == id->ino) {
+			if (0 == memcmp(&e->id, id, sizeof(*id))) {
+				memcpy(digest, e->digest, DIGEST_LEN);
+				rv = 0;
+			}
+			break;
+		}
+	}
+
+fin:
+	pthread_mutex_unlock(&cache_lock);
+	return rv;
+}
+
+
+/*
+ * cache_insert does the work of cache_put; the caller holds cache_lock.
+ */
+static void
+cache_insert(const struct ident *id, const unsigned char *digest)
+{
+	struct cache_ent	*old;
+	size_t			 i, n;
+
+	if (NULL == cache) {
+		return;
+	}
+
+	/* Keep the table at most half full. */
+	if (2 * (cache->nused + 1) > cache->nslots) {
+		n = cache->nslots;
+		if (NULL == (old = malloc(n * sizeof(*old)))) {
+			return;
+		}
+		memcpy(old, cache_ents, n * sizeof(*old));
+
+		if (-1 == cache_map(2 * n, 1)) {
+			free(old);
+			close(cache_fd);
+			cache_fd = -1;
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			if (0 != old[i].id.ino) {
+				cache_insert(&old[i].id, old[i].digest);
+			}
+		}
+		free(old);
+	}
+
+	for (i = cache_slot(id); 0 != cache_ents[i].id.ino;
+	    i = (i + 1) & (cache->nslots - 1)) {
+		if (cache_ents[i].id.dev == id->dev &&
+		    cache_ents[i].id.ino == id->ino) {
+			break;
+		}
+	}
+
+	if (0 == cache_ents[i].id.ino) {
+		cache->nused++;
+	}
+	cache_ents[i].id = *id;
+	memcpy(cache_ents[i].digest, digest, DIGEST_LEN);
+}
+
+
+static void
+cache_put(const struct ident *id, const unsigned char *digest)
+{
+	pthread_mutex_lock(&cache_lock);
+	cache_insert(id, digest);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+/*
+ * tree_init sets S up for the node at offset in level depth of the
+ * hash tree; leaves are depth 0. last marks the rightmost node of a
+ * level.
+ */
+static void
+tree_init(struct blake2s *S, uint64_t offset, uint32_t depth, int last)
+{
+	memset(S, 0, sizeof(*S));
+	memcpy(S->h, blake2s_iv, sizeof(S->h));
+
+	/* Fanout 2, unlimited depth, TREE_LEAF leaves, 32 byte inner nodes. */
+	S->h[0] ^= DIGEST_LEN | 2 << 16 | 255U << 24;
+	S->h[1] ^= TREE_LEAF;
+	S->h[2] ^= (uint32_t)offset;
+	S->h[3] ^= ((uint32_t)(offset >> 32) & 0xffff) | depth << 16 |
+	    (uint32_t)DIGEST_LEN << 24;
+	if (last) {
+		S->f[1] = 0xffffffff;
+	}
+}
+
+
+/*
+ * A tree_job is one file being hashed, either at p or, if that's NULL,
+ * read from fd; each thread claims TREE_BATCH leaves at a time until
+ * they've all been done. The first read to fail sets error, and the
+ * rest give up. incore, if known, says which of the file's pages were
+ * cached when it started.
+ */
+struct tree_job {
+	const unsigned char	*p;
+	int			 fd;
+	atomic_int		 error;
+	unsigned char		*incore;
+	size_t			 pagesz;
+	size_t			 size;
+	size_t			 nleaves;
+	unsigned char		*leaves;
+	atomic_size_t		 next;
+	atomic_long		 helping;
+	dev_t			 dev;
+	int			 critical;
+};
+
+/* A tree_help is a pool job that joins in on a tree_job. */
+struct tree_help {
+	struct job	 job;
+	struct tree_job	*tj;
+};
+
+
+/*
+ * tree_read hashes the n bytes at offs into S, reading them from j's
+ * file. A short read means the file was truncated while it was being
+ * hashed.
+ */
+static int
+tree_read(struct tree_job *j, struct blake2s *S, unsigned char *buf,
+    size_t offs, size_t n)
+{
+	ssize_t	 r;
+	size_t	 want;
+
+	while (n > 0) {
+		want = n < HASH_READ ? n : HASH_READ;
+		if ((r = pread(j->fd, buf, want, (off_t)offs)) <= 0) {
+			if (-1 == r && EINTR == errno) {
+				continue;
+			}
+			atomic_store(&j->error, -1 == r ? errno : ESTALE);
+			return -1;
+		}
+		blake2s_update(S, buf, (size_t)r);
+		offs += (size_t)r;
+		n -= (size_t)r;
+	}
+	return 0;
+}
+
+
+/*
+ * tree_charge charges the reads of bytes offs to end of j's file to its
+ * device's I/O budget, leaving out any pages that were cached when the
+ * hash started, since reading those costs the device nothing.
+ */
+static void
+tree_charge(struct tree_job *j, size_t offs, size_t end)
+{
+	size_t	 pg, bytes = 0;
+
+	if (NULL == j->incore) {
+		throttle(j->dev, end - offs, j->critical);
+		return;
+	}
+	for (pg = offs / j->pagesz; pg * j->pagesz < end; pg++) {
+		if (!(j->incore[pg] & 1)) {
+			bytes += j->pagesz;
+		}
+	}
+	if (bytes > 0) {
+		throttle(j->dev, bytes, j->critical);
+	}
+}
+
+
+/*
+ * tree_incore notes which of j's file's pages are in the page cache,
+ * for tree_charge. The file is mapped only to ask; it's never touched,
+ * so it can't fault if the file shrinks.
+ */
+static void
+tree_incore(struct tree_job *j)
+{
+	void	*p;
+
+	j->pagesz = (size_t)sysconf(_SC_PAGESIZE);
+	p = mmap(NULL, j->size, PROT_READ, MAP_SHARED, j->fd, 0);
+	if (MAP_FAILED == p) {
+		return;
+	}
+	j->incore = arena_alloc((j->size + j->pagesz - 1) / j->pagesz);
+	if (-1 == mincore(p, j->size, j->incore)) {
+		j->incore = NULL;
+	}
+	munmap(p, j->size);
+}
+
+
+static void
+tree_leaves(struct tree_job *j)
+{
+	struct blake2s	 S;
+	unsigned char	*buf = NULL;
+	size_t		 i, end, offs, n;
+
+	if (NULL == j->p) {
+		buf = arena_alloc(HASH_READ);
+	}
+
+	while ((i = atomic_fetch_add(&j->next, TREE_BATCH)) < j->nleaves) {
+		if (0 != atomic_load(&j->error)) {
+			return;
+		}
+		end = i + TREE_BATCH;
+		if (end > j->nleaves) {
+			end = j->nleaves;
+		}
+
+		pool_preempt();
+
+		if (NULL != buf) {
+			tree_charge(j, i * TREE_LEAF, end * TREE_LEAF <
+			    j->size ? end * TREE_LEAF : j->size);
+		}
+
+		for (offs = i * TREE_LEAF; i < end; i++, offs += n) {
+			n = j->size - offs < TREE_LEAF ? j->size - offs :
+			    TREE_LEAF;
+			tree_init(&S, i, 0, i == j->nleaves - 1);
+			if (NULL != buf) {
+				if (-1 == tree_read(j, &S, buf, offs, n)) {
+					return;
+				}
+			} else {
+				blake2s_update(&S, j->p + offs, n);
+			}
+			blake2s_final(&S, j->leaves + i * DIGEST_LEN);
+		}
+	}
+}
+
+
+static void
+tree_help(struct job *job)
+{
+	struct tree_help	*h = (struct tree_help *)job;
+
+	tree_leaves(h->tj);
+}
+
+
+/*
+ * tree_digest hashes size bytes at p, or read from fd if p is NULL, on
+ * up to nthreads threads: this one, and helpers submitted to the pool.
+ * The leaves are hashed in parallel; the levels above them are cheap by
+ * comparison (one compression per pair) and are folded up serially. An
+ * odd node out at the end of a level is carried up unchanged.
+ */
+static int
+tree_digest(const unsigned char *p, int fd, size_t size, dev_t dev,
+    int critical, long nthreads, unsigned char *digest)
+{
+	struct tree_job		 j;
+	struct tree_help	*helps = NULL;
+	struct blake2s		 S;
+	size_t			 n, i;
+	uint32_t		 depth;
+	long			 t;
+
+	memset(&j, 0, sizeof(j));
+	j.p = p;
+	j.fd = fd;
+	j.size = size;
+	j.nleaves = size > 0 ? (size + TREE_LEAF - 1) / TREE_LEAF : 1;
+	j.dev = dev;
+	j.critical = critical;
+	atomic_init(&j.next, 0);
+	atomic_init(&j.helping, 0);
+	atomic_init(&j.error, 0);
+	j.leaves = arena_alloc(j.nleaves * DIGEST_LEN);
+	if (NULL == p && size > 0) {
+		tree_incore(&j);
+	}
+
+	if (size < HASH_PARALLEL_MIN) {
+		nthreads = 1;
+	}
+	if (nthreads > nworkers + (NULL == self)) {
+		nthreads = nworkers + (NULL == self);
+	}
+	if ((size_t)nthreads > (j.nleaves + TREE_BATCH - 1) / TREE_BATCH) {
+		nthreads = (long)((j.nleaves + TREE_BATCH - 1) / TREE_BATCH);
+	}
+
+	if (nthreads > 1) {
+		helps = arena_alloc((size_t)(nthreads - 1) * sizeof(*helps));
+		memset(helps, 0, (size_t)(nthreads - 1) * sizeof(*helps));
+		atomic_store(&j.helping, nthreads - 1);
+		for (t = 0; t < nthreads - 1; t++) {
+			helps[t].job.fn = tree_help;
+			helps[t].job.finished = &j.helping;
+			helps[t].job.class = running;
+			helps[t].tj = &j;
+			pool_submit(&helps[t].job);
+		}
+	}
+	tree_leaves(&j);
+	pool_help(&j.helping);
+	if (0 != atomic_load(&j.error)) {
+		errno = atomic_load(&j.error);
+		return -1;
+	}
+
+	for (n = j.nleaves, depth = 1; n > 1; n = (n + 1) / 2, depth++) {
+		for (i = 0; i < n / 2; i++) {
+			tree_init(&S, i, depth, i == (n + 1) / 2 - 1);
+			blake2s_update(&S, j.leaves + 2 * i * DIGEST_LEN,
+			    2 * DIGEST_LEN);
+			blake2s_final(&S, j.leaves + i * DIGEST_LEN);
+		}
+		if (n & 1) {
+			memmove(j.leaves + i * DIGEST_LEN,
+			    j.leaves + (n - 1) * DIGEST_LEN, DIGEST_LEN);
+		}
+	}
+
+	memcpy(digest, j.leaves, DIGEST_LEN);
+	return 0;
+}
+
+
+/*
+ * digest_fd hashes the file open on fd, charging the reads to dev's
+ * I/O budget. id is the file's identity, and is used to check and
+ * update the digest cache.
+ */
+static int
+digest_fd(int fd, const struct ident *id, dev_t dev, int critical,
+    unsigned char *digest)
+{
+	uint64_t	 start;
+	int		 rv;
+
+	if (0 == cache_get(id, digest)) {
+		return 0;
+	}
+
+	start = now_ns();
+	rv = tree_digest(NULL, fd, id->size, dev, critical, nworkers, digest);
+	trace_span("hash", start, now_ns(), NULL);
+
+	if (0 == rv) {
+		cache_put(id, digest);
+	}
+	return rv;
+}
+
+
+#ifndef PERSIST_SMALL
+/*
+ * hash_bench hashes path on 1 to N pool threads, where N is the number
+ * of online CPUs, and prints the throughput and speedup of each, to show
+ * how tree hashing scales on this host.
+ */
+static void
+hash_bench(const char *path)
+{
+	struct stat	 st;
+	unsigned char	 digest[DIGEST_LEN];
+	unsigned char	*p;
+	uint64_t	 start, elapsed, base = 0;
+	long		 t, n;
+	int		 fd;
+
+	if (-1 == (fd = open(path, O_RDONLY)) || -1 == fstat(fd, &st) ||
+	    0 == st.st_size) {
+		errx(EXIT_FAILURE, "%s: need a non-empty file", path);
+	}
+
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE|MAP_POPULATE,
+	    fd, 0);
+	if (MAP_FAILED == p) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	pool_init(n);
+	printf("threads\tMB/s\tspeedup\n");
+	for (t = 1; t <= (n > 0 ? n : 1); t++) {
+		start = now_ns();
+		tree_digest(p, -1, (size_t)st.st_size, st.st_dev, 1, t,
+		    digest);
+		elapsed = now_ns() - start;
+		if (1 == t) {
+			base = elapsed;
+		}
+		printf("%ld\t%.1f\t%.2f\n", t, (double)st.st_size /
+		    ((double)elapsed / 1e3), (double)base / (double)elapsed);
+	}
+
+	munmap(p, (size_t)st.st_size);
+	close(fd);
+}
+#endif
+
+
+
+/*
+ * verity_enable turns fs-verity on for the file open read-only on fd.
+ * It's fine if it's already on.
+ */
+static int
+verity_enable(int fd)
+{
+	struct fsverity_enable_arg	 arg;
+
+	memset(&arg, 0, sizeof(arg));
+	arg.version = 1;
+	arg.hash_algorithm = FS_VERITY_HASH_ALG_SHA256;
+	arg.block_size = 4096;
+
+	if (-1 == ioctl(fd, FS_IOC_ENABLE_VERITY, &arg) && EEXIST != errno) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * verity_measure fetches the fs-verity digest of the file open on fd.
+ * This is O(1): the kernel keeps it in the file's verity metadata.
+ */
+static int
+verity_measure(int fd, unsigned char *digest)
+{
+	unsigned char		 buf[sizeof(struct fsverity_digest) + 64]
+				    __attribute__((aligned(8)));
+	struct fsverity_digest	*d = (struct fsverity_digest *)buf;
+
+	d->digest_size = 64;
+	if (-1 == ioctl(fd, FS_IOC_MEASURE_VERITY, d) ||
+	    FS_VERITY_HASH_ALG_SHA256 != d->digest_algorithm ||
+	    DIGEST_LEN != d->digest_size) {
+		return -1;
+	}
+	memcpy(digest, d->digest, DIGEST_LEN);
+	return 0;
+}
+
+
+/*
+ * learn records what a's contents should be, from its original inode:
+ * the verity measurement if it can be had, otherwise the digest.
+ */
+static int
+learn(struct artifact *a, int verity)
+{
+	struct statx	 stx;
+
+	/* Enabling verity changes the inode, so it goes first. */
+	a->verity = verity && 0 == verity_enable(a->src) &&
+	    0 == verity_measure(a->src, a->digest);
+
+	if (-1 == statx(a->src, "", AT_EMPTY_PATH, STATX_BASIC_STATS, &stx)) {
+		return -1;
+	}
+	ident_statx(&a->id, &stx);
+
+	if (!a->verity && -1 == digest_fd(a->src, &a->id, a->dev,
+	    a->critical, a->digest)) {
+		return -1;
+	}
+
+	a->digested = 1;
+	return 0;
+}
+
+
+/*
+ * restore copies a's original inode back to its path using the
+ * sendfile(2) syscall, a chunk at a time so the copy can be throttled.
+ * The copy is written alongside and renamed into place, so whatever is
+ * at the path now (if anything) is replaced atomically. The new inode
+ * goes straight into the digest cache.
+ */
+static int
+restore(struct artifact *a)
+{
+	struct statx	 stx;
+	struct ident	 id;
+	char		*tmp;
+	off_t		 offs = 0, chunk;
+	ssize_t		 n;
+	int		 dst, rv = -1;
+
+	tmp = arena_cat(a->path, ".persist~", NULL);
+	if (-1 == (dst = open(tmp, O_CREAT|O_WRONLY|O_TRUNC|O_CLOEXEC,
+	    a->mode))) {
+		return -1;
+	}
+	fchmod(dst, a->mode);
+
+	while (offs < (off_t)a->id.size) {
+		chunk = (off_t)a->id.size - offs;
+		if (chunk > RESTORE_CHUNK) {
+			chunk = RESTORE_CHUNK;
+		}
+		pool_preempt();
+		throttle(a->dev, (size_t)chunk, a->critical);
+		n = sendfile(dst, a->src, &offs, (size_t)chunk);
+		if (n <= 0) {
+			unlink(tmp);
+			goto fin;
+		}
+	}
+
+	/*
+	 * Verity can only be enabled with no writers, so the copy is
+	 * reopened read-only. If it won't take on the copy, the artifact
+	 * falls back to being hashed, or it would never verify.
+	 */
+	if (a->verity) {
+		close(dst);
+		if (-1 == (dst = open(tmp, O_RDONLY|O_CLOEXEC))) {
+			unlink(tmp);
+			return -1;
+		}
+		if (-1 == verity_enable(dst) && -1 == learn(a, 0)) {
+			unlink(tmp);
+			goto fin;
+		}
+	}
+
+	if (-1 == rename(tmp, a->path)) {
+		unlink(tmp);
+		goto fin;
+	}
+
+	if (!a->verity &&
+	    0 == statx(dst, "", AT_EMPTY_PATH, STATX_BASIC_STATS, &stx)) {
+		ident_statx(&id, &stx);
+		cache_put(&id, a->digest);
+	}
+	rv = 0;
+
+fin:
+	close(dst);
+	return rv;
+}
+
+
+/*
+ * init prepopulates the original exe pathname.
+ *
+ * before we start forking around (keeping in mind the child process
+ * will attempt to rename itself), we need to know where the original
+ * program is. this probably should be done before the file is deleted,
+ * otherwise the " (deleted)" part of the name needs to be removed,
+ * which is doable but extra work.
+ *
+ * this exe name is kept around so we know where to write the restored
+ * file to in the event the original is deleted. this works by using
+ * the Linux procfs system: /proc/$$/exe is a special link; it can be
+ * read like a normal file (even if the target is deleted), and if
+ * readlink(2) is called on it, it returns the original path to the
+ * program (with " (deleted)" appended if the original was unlinked).
+ */
+static void
+init(void)
+{
+	char	*p = NULL;
+	int	 src;
+
+	memset(exe, 0, sizeof(exe));
+	asprintf(&p, "/proc/%u/exe", pid);
+	exelen = readlink(p, exe, sizeof(exe) - 1);
+
+	if (-1 == exelen) {
+		err(EXIT_FAILURE, "couldn't look up original file (%u, %s)", pid, p);
+	}
+
+	/*
+	 * The exe is always the first artifact, and always critical:
+	 * check_run can't restart the parent without it.
+	 */
+	if (-1 == (src = open(p, O_RDONLY|O_CLOEXEC))) {
+		err(EXIT_FAILURE, "couldn't open original file (%s)", p);
+	}
+	free(p);
+	add_artifact(exe, src, 1);
+
+	iolimit_init(&io_global, 0, IO_GLOBAL_BPS, IO_GLOBAL_IOPS);
+
+	name_diff = (strlen(BIN_NAME) - strlen(WATCHER_NAME));
+}
+
+
+/*
+ * verify checks that the file at a's path, described by stx, has the
+ * contents a should. For a verity artifact that's a single ioctl;
+ * otherwise the file is only read if the digest cache doesn't know it
+ * already.
+ */
+static int
+verify(struct artifact *a, const struct statx *stx)
+{
+	struct statx	 fstx;
+	struct ident	 id;
+	unsigned char	 digest[DIGEST_LEN];
+	int		 fd, rv;
+
+	ident_statx(&id, stx);
+	if (0 == memcmp(&id, &a->id, sizeof(id)) || (!a->verity &&
+	    0 == cache_get(&id, digest) &&
+	    0 == memcmp(digest, a->digest, DIGEST_LEN))) {
+		return 0;
+	}
+
+	if (a->verity && !(stx->stx_attributes & STATX_ATTR_VERITY)) {
+		return -1;
+	}
+
+	if (-1 == (fd = open(a->path, O_RDONLY|O_CLOEXEC))) {
+		return -1;
+	}
+
+	rv = -1;
+	if (a->verity) {
+		if (0 == verity_measure(fd, digest) &&
+		    0 == memcmp(digest, a->digest, DIGEST_LEN)) {
+			rv = 0;
+		}
+	} else if (0 == statx(fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS,
+	    &fstx)) {
+		ident_statx(&id, &fstx);
+		if (0 == digest_fd(fd, &id, a->dev, a->critical, digest) &&
+		    0 == memcmp(digest, a->digest, DIGEST_LEN)) {
+			rv = 0;
+		}
+	}
+
+	close(fd);
+	return rv;
+}
+
+
+/*
+ * check_artifact restores a if it's missing or its contents have
+ * changed. The first time round, it learns what the contents should be
+ * from the original inode.
+ */
+static void
+check_artifact(struct artifact *a)
+{
+	struct statx	 stx;
+	uint64_t	 start, ns;
+	long		 id = (long)(a - artifacts);
+	int		 rv;
+
+	if (!a->digested && -1 == learn(a, USE_VERITY)) {
+		warn("couldn't hash %s", a->path);
+		return;
+	}
+
+	throttle(a->dev, 0, a->critical);
+	if (0 == statx(AT_FDCWD, a->path, 0, STATX_BASIC_STATS, &stx)) {
+		PROBE3(verify__start, id, pid, a->path);
+		start = now_ns();
+		rv = verify(a, &stx);
+		ns = op_done(OP_VERIFY, start, a->path);
+		PROBE4(verify__end, id, pid, ns, rv);
+		if (0 == rv) {
+			/*
+			 * The original is in place, and we don't need to do
+			 * anything.
+			 */
+			return;
+		}
+
+		/*
+		 * If the path is still the original inode, it was changed
+		 * in place, and the source of any restore would be too.
+		 */
+		if (stx.stx_ino == a->id.ino && a->id.dev ==
+		    makedev(stx.stx_dev_major, stx.stx_dev_minor)) {
+			syslog(LOG_WARNING, "%s was modified in place",
+			    a->path);
+			return;
+		}
+	}
+
+	PROBE3(restore__start, id, pid, a->path);
+	start = now_ns();
+	rv = restore(a);
+	ns = op_done(OP_RESTORE, start, a->path);
+	PROBE4(restore__end, id, pid, ns, rv);
+	if (-1 == rv) {
+		if (a->critical) {
+			err(EXIT_FAILURE, "failed to restore %s", a->path);
+		}
+		warn("failed to restore %s", a->path);
+		return;
+	}
+	a->restored = 1;
+}
+
+
+static void	artifact_checked(struct job *);
+
+
+static void
+artifact_job(struct job *j)
+{
+	check_artifact((struct artifact *)j);
+}
+
+
+/*
+ * artifact_submit queues a check of a on the pool in the given job
+ * class. Only one check of an artifact runs at a time; asking again
+ * while one is running queues another for when it's done, in the most
+ * urgent class asked for.
+ */
+static void
+artifact_submit(struct artifact *a, int class)
+{
+	if (a->busy) {
+		if (!a->again || class < a->again_class) {
+			a->again_class = class;
+		}
+		a->again = 1;
+		return;
+	}
+
+	a->busy = 1;
+	a->again = 0;
+	a->job.fn = artifact_job;
+	a->job.done = artifact_checked;
+	a->job.class = class;
+	pool_submit(&a->job);
+}
+
+
+static void	mon_rekey(struct artifact *);
+
+
+static void
+artifact_checked(struct job *j)
+{
+	struct artifact	*a = (struct artifact *)j;
+	void		(*then)(void) = a->then;
+
+	a->busy = 0;
+	a->then = NULL;
+	if (a->restored && -1 != mon_fd) {
+		a->restored = 0;
+		mon_rekey(a);
+	}
+	if (NULL != then) {
+		then();
+	}
+	if (a->again) {
+		artifact_submit(a, a->again_class);
+	}
+}
+
+
+/*
+ * check_bin makes sure each artifact is present. missing ones are
+ * restored from their original inodes, critical ones first: if a whole
+ * tree of artifacts vanished at once, the ones check_run needs shouldn't
+ * queue up behind the rest. Critical artifacts are checked on the
+ * restart path; the rest is housekeeping.
+ *
+ * Once the monitor is up this is only needed at startup and when the
+ * kernel drops events.
+ */
+static void
+check_bin(void)
+{
+	size_t	 i;
+	int	 pass;
+
+	for (pass = 1; pass >= 0; pass--) {
+		for (i = 0; i < nartifacts; i++) {
+			if (artifacts[i].critical == pass) {
+				artifact_submit(&artifacts[i], pass ?
+				    JOB_RESTART : JOB_HOUSEKEEPING);
+			}
+		}
+	}
+}
+
+
+/*
+ * mon_key builds a monitor key from a directory identity and a name, in
+ * scratch memory.
+ */
+static unsigned char *
+mon_key(const void *dir, size_t dirlen, const char *name, size_t *keylen)
+{
+	unsigned char	*key;
+	size_t		 namelen = strlen(name);
+
+	key = arena_alloc(dirlen + namelen);
+	memcpy(key, dir, dirlen);
+	memcpy(key + dirlen, name, namelen);
+	*keylen = dirlen + namelen;
+	return key;
+}
+
+
+/*
+ * mon_lookup returns the artifact matching key, or NULL. The index is
+ * open-addressed and holds artifact indices plus one, so 0 is empty.
+ */
+static struct artifact *
+mon_lookup(const unsigned char *key, size_t keylen)
+{
+	struct artifact	*a;
+	size_t		 i;
+
+	if (0 == mon_index_size) {
+		return NULL;
+	}
+
+	i = hash(key, keylen) & (mon_index_size - 1);
+	for (; 0 != mon_index[i]; i = (i + 1) & (mon_index_size - 1)) {
+		a = &artifacts[mon_index[i] - 1];
+		if (a->keylen == keylen && 0 == memcmp(a->key, key, keylen)) {
+			return a;
+		}
+	}
+	return NULL;
+}
+
+
+static void
+mon_index_build(void)
+{
+	size_t	 i, j;
+
+	mon_index_size = 16;
+	while (mon_index_size < nartifacts * 2) {
+		mon_index_size <<= 1;
+	}
+
+	free(mon_index);
+	if (NULL == (mon_index = calloc(mon_index_size, sizeof(size_t)))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+
+	for (i = 0; i < nartifacts; i++) {
+		if (NULL == artifacts[i].key) {
+			continue;
+		}
+		j = hash(artifacts[i].key, artifacts[i].keylen) &
+		    (mon_index_size - 1);
+		while (0 != mon_index[j]) {
+			j = (j + 1) & (mon_index_size - 1);
+		}
+		mon_index[j] = i + 1;
+	}
+}
+
+
+/*
+ * fan_dir identifies dir the way a FAN_REPORT_DFID_NAME event does: the
+ * filesystem id, then the file handle. The first time a filesystem is
+ * seen, the whole of it is marked.
+ */
+static int
+fan_dir(const char *dir, dev_t dev, unsigned char *id, size_t *idlen)
+{
+	static dev_t	*marked = NULL;
+	static size_t	 nmarked = 0;
+	struct statfs	 sfs;
+	struct file_handle *fh;
+	size_t		 i;
+	int		 mount_id;
+
+	if (-1 == statfs(dir, &sfs)) {
+		return -1;
+	}
+
+	fh = (struct file_handle *)(id + sizeof(sfs.f_fsid));
+	fh->handle_bytes = MAX_HANDLE_SZ;
+	if (-1 == name_to_handle_at(AT_FDCWD, dir, fh, &mount_id, 0)) {
+		return -1;
+	}
+	memcpy(id, &sfs.f_fsid, sizeof(sfs.f_fsid));
+	*idlen = sizeof(sfs.f_fsid) + sizeof(*fh) + fh->handle_bytes;
+
+	for (i = 0; i < nmarked; i++) {
+		if (marked[i] == dev) {
+			return 0;
+		}
+	}
+
+	if (-1 == fanotify_mark(mon_fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM,
+	    FAN_EVENTS, AT_FDCWD, dir)) {
+		return -1;
+	}
+
+	marked = reallocarray(marked, nmarked + 1, sizeof(*marked));
+	if (NULL == marked) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	marked[nmarked++] = dev;
+	return 0;
+}
+
+
+/*
+ * mon_add keys a on its directory, watching that directory (or its
+ * filesystem) as needed.
+ */
+static int
+mon_add(struct artifact *a)
+{
+	unsigned char	 id[sizeof(fsid_t) + sizeof(struct file_handle) +
+			    MAX_HANDLE_SZ];
+	unsigned char	*key;
+	char		 dir[PATH_MAX];
+	char		*base;
+	size_t		 idlen;
+	int		 wd;
+
+	if (strlen(a->path) >= sizeof(dir) ||
+	    NULL == (base = strrchr(a->path, '/'))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(dir, a->path, (size_t)(base - a->path));
+	dir[base - a->path] = 0;
+	if (base == a->path) {
+		strcpy(dir, "/");
+	}
+	base++;
+
+	if (mon_fanotify) {
+		if (-1 == fan_dir(dir, a->dev, id, &idlen)) {
+			return -1;
+		}
+	} else {
+		if (-1 == (wd = inotify_add_watch(mon_fd, dir, IN_EVENTS))) {
+			return -1;
+		}
+		memcpy(id, &wd, sizeof(wd));
+		idlen = sizeof(wd);
+	}
+
+	key = mon_key(id, idlen, base, &a->keylen);
+	free(a->key);
+	if (NULL == (a->key = malloc(a->keylen))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	memcpy(a->key, key, a->keylen);
+	return 0;
+}
+
+
+/*
+ * mon_init starts monitoring every artifact. fanotify needs
+ * CAP_SYS_ADMIN for filesystem marks; if it isn't available, or any
+ * mark is refused, everything is watched with inotify instead.
+ */
+static void
+mon_init(void)
+{
+	size_t	 i;
+
+	mon_fd = fanotify_init(FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK|
+	    FAN_REPORT_DFID_NAME, O_RDONLY);
+	mon_fanotify = (-1 != mon_fd);
+
+	for (i = 0; mon_fanotify && i < nartifacts; i++) {
+		if (-1 == mon_add(&artifacts[i])) {
+			close(mon_fd);
+			mon_fanotify = 0;
+		}
+	}
+
+	if (!mon_fanotify) {
+		if (-1 == (mon_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC))) {
+			err(EXIT_FAILURE, "couldn't start monitoring");
+		}
+		for (i = 0; i < nartifacts; i++) {
+			if (-1 == mon_add(&artifacts[i])) {
+				warn("couldn't watch %s", artifacts[i].path);
+			}
+		}
+	}
+
+	mon_index_build();
+}
+
+
+/*
+ * fan_event resolves a single fanotify event to an artifact.
+ */
+static struct artifact *
+fan_event(struct fanotify_event_metadata *ev)
+{
+	struct fanotify_event_info_fid	*fid;
+	struct file_handle		*fh;
+	unsigned char			*key;
+	char				*p, *end, *name;
+	size_t				 keylen, idlen;
+
+	p = (char *)ev + ev->metadata_len;
+	end = (char *)ev + ev->event_len;
+	for (; p < end; p += fid->hdr.len) {
+		fid = (struct fanotify_event_info_fid *)p;
+		if (0 == fid->hdr.len) {
+			break;
+		}
+		if (FAN_EVENT_INFO_TYPE_DFID_NAME != fid->hdr.info_type) {
+			continue;
+		}
+
+		fh = (struct file_handle *)fid->handle;
+		name = (char *)fh->f_handle + fh->handle_bytes;
+		idlen = sizeof(fid->fsid) + sizeof(*fh) + fh->handle_bytes;
+
+		key = mon_key(&fid->fsid, idlen, name, &keylen);
+		return mon_lookup(key, keylen);
+	}
+	return NULL;
+}
+
+
+/*
+ * artifact_due runs when a pending artifact's timer fires. If more
+ * events arrived in the meantime, the check is pushed back.
+ */
+static void
+artifact_due(void *arg)
+{
+	struct artifact	*a = arg;
+
+	if (!a->pending) {
+		return;
+	}
+
+	if (a->due > now_ns()) {
+		timer_add(a->due, artifact_due, a);
+		return;
+	}
+
+	a->pending = 0;
+	artifact_submit(a, a->critical ? JOB_RESTART : JOB_VERIFY);
+}
+
+
+/*
+ * artifact_scrub is the periodic re-verify of an artifact, in case the
+ * monitor missed a change. It's skipped under pressure. Critical
+ * artifacts are scrubbed as probes, so check_run is never left waiting
+ * on one that's paused.
+ */
+static void
+artifact_scrub(void *arg)
+{
+	struct artifact	*a = arg;
+
+	if (0 == pressure_until) {
+		artifact_submit(a, a->critical ? JOB_PROBE : JOB_VERIFY);
+	}
+}
+
+
+/*
+ * mon_event records an event on a, scheduling a check after the quiet
+ * window. closed means a writer just finished with it, or a whole file
+ * was renamed over it, so there's no point waiting any longer.
+ */
+static void
+mon_event(struct artifact *a, int closed)
+{
+	uint64_t	 now = now_ns();
+
+	if (!a->pending) {
+		a->pending = 1;
+		a->deadline = now + COALESCE_MAX_MS * MSEC;
+		timer_add(now + COALESCE_MS * MSEC, artifact_due, a);
+	}
+
+	a->due = closed ? now : now + COALESCE_MS * MSEC;
+	if (a->due > a->deadline) {
+		a->due = a->deadline;
+	}
+
+	if (closed) {
+		timer_add(a->due, artifact_due, a);
+	}
+}
+
+
+/*
+ * mon_rewatch handles the inotify watch wd going away with its
+ * directory: the artifacts in it are watched again, if the directory's
+ * been replaced, and checked either way.
+ */
+static void
+mon_rewatch(int wd)
+{
+	struct artifact	*a;
+	size_t		 i;
+
+	for (i = 0; i < nartifacts; i++) {
+		a = &artifacts[i];
+		if (NULL == a->key || a->keylen < sizeof(wd) ||
+		    0 != memcmp(a->key, &wd, sizeof(wd))) {
+			continue;
+		}
+		if (-1 == mon_add(a)) {
+			warn("couldn't watch %s", a->path);
+			free(a->key);
+			a->key = NULL;
+		}
+		mon_event(a, 1);
+	}
+	mon_index_build();
+}
+
+
+/*
+ * mon_rekey works out a's key again after it's been restored, and
+ * reindexes if it moved. Without it, an artifact restored into a
+ * directory that replaced the watched one would go unwatched.
+ */
+static void
+mon_rekey(struct artifact *a)
+{
+	unsigned char	*old = a->key;
+	size_t		 oldlen = a->keylen;
+
+	a->key = NULL;
+	if (-1 == mon_add(a)) {
+		warn("couldn't watch %s", a->path);
+	} else if (NULL != old && oldlen == a->keylen &&
+	    0 == memcmp(old, a->key, oldlen)) {
+		free(old);
+		return;
+	}
+	free(old);
+	mon_index_build();
+}
+
+
+/*
+ * mon_read drains the monitor, passing each event that names an artifact
+ * on to be coalesced. If the kernel's queue overflowed, events were
+ * lost, and everything gets checked.
+ */
+static void
+mon_read(struct handler *h)
+{
+	char				 buf[8192] __attribute__((aligned(8)));
+	struct fanotify_event_metadata	*fev;
+	struct inotify_event		*iev;
+	struct artifact			*a;
+	unsigned char			*key;
+	size_t				 keylen;
+	ssize_t				 n;
+	char				*p;
+
+	while ((n = read(h->fd, buf, sizeof(buf))) > 0) {
+		if (mon_fanotify) {
+			for (fev = (struct fanotify_event_metadata *)buf;
+			    FAN_EVENT_OK(fev, n);
+			    fev = FAN_EVENT_NEXT(fev, n)) {
+				if (fev->mask & FAN_Q_OVERFLOW) {
+					check_bin();
+				} else if (NULL != (a = fan_event(fev))) {
+					mon_event(a, fev->mask &
+					    (FAN_CLOSE_WRITE|FAN_MOVED_TO));
+				}
+			}
+			continue;
+		}
+
+		for (p = buf; p < buf + n; p += sizeof(*iev) + iev->len) {
+			iev = (struct inotify_event *)p;
+			if (iev->mask & IN_Q_OVERFLOW) {
+				check_bin();
+				continue;
+			}
+			if (iev->mask & IN_IGNORED) {
+				mon_rewatch(iev->wd);
+				continue;
+			}
+			if (0 == iev->len) {
+				continue;
+			}
+
+			key = mon_key(&iev->wd, sizeof(iev->wd), iev->name,
+			    &keylen);
+			if (NULL != (a = mon_lookup(key, keylen))) {
+				mon_event(a, iev->mask &
+				    (IN_CLOSE_WRITE|IN_MOVED_TO));
+			}
+		}
+	}
+}
+
+
+/*
+ * loop_link adds st to the list the control socket reports on.
+ */
+static void
+loop_link(struct loopstat *st)
+{
+	if (!st->linked) {
+		st->next = loopstats;
+		loopstats = st;
+		st->linked = 1;
+	}
+}
+
+
+/*
+ * loop_account charges st with the time and counts since s, and flags
+ * it if that was over budget.
+ */
+static void
+loop_account(struct loopstat *st, const struct sample *s)
+{
+	uint64_t	 end = now_ns(), ns = end - s->ns, pmc[NPMC];
+	int		 i;
+
+	trace_span(st->name, s->ns, end, NULL);
+	if (sample_delta(s, pmc)) {
+		st->pruns++;
+		for (i = 0; i < NPMC; i++) {
+			st->pmc[i] += pmc[i];
+		}
+	}
+	st->runs++;
+	st->ns += ns;
+	if (ns > st->max) {
+		st->max = ns;
+	}
+	if (ns > LOOP_BUDGET_MS * MSEC) {
+		st->over++;
+		syslog(LOG_WARNING, "%s held the event loop for %llu ms",
+		    st->name, (unsigned long long)(ns / MSEC));
+	}
+}
+
+
+/*
+ * add_handler registers h with the event loop.
+ */
+static void
+add_handler(struct handler *h)
+{
+	struct epoll_event	 ev;
+
+	loop_link(h->stat);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = h->events ? h->events : EPOLLIN;
+	ev.data.ptr = h;
+	if (-1 == epoll_ctl(epfd, EPOLL_CTL_ADD, h->fd, &ev)) {
+		err(EXIT_FAILURE, "couldn't watch %s", h->name);
+	}
+}
+
+
+/*
+ * del_handler stops watching h's fd and closes it. It's taken out of
+ * epoll first: a copy of the fd in a child that hasn't exec'd yet would
+ * keep it registered, and the loop would be handed h after it's gone.
+ */
+static void
+del_handler(struct handler *h)
+{
+	epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, NULL);
+	close(h->fd);
+	h->fd = -1;
+}
+
+
+/*
+ * out_printf appends to c's reply.
+ */
+static void
+out_printf(struct conn *c, const char *fmt, ...)
+{
+	va_list	 ap;
+	char	*p;
+	size_t	 cap;
+	int	 n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(c->out + c->outlen, c->outcap - c->outlen, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+		return;
+	}
+
+	if ((size_t)n >= c->outcap - c->outlen) {
+		for (cap = c->outcap ? c->outcap : 4096;
+		    cap - c->outlen <= (size_t)n; cap *= 2) {
+			continue;
+		}
+		if (NULL == (p = realloc(c->out, cap))) {
+			return;
+		}
+		c->out = p;
+		c->outcap = cap;
+		va_start(ap, fmt);
+		vsnprintf(c->out + c->outlen, c->outcap - c->outlen, fmt, ap);
+		va_end(ap);
+	}
+	c->outlen += (size_t)n;
+}
+
+
+/*
+ * out_profile appends a row of the profile table: counts per run, and
+ * instructions per cycle.
+ */
+static void
+out_profile(struct conn *c, const char *name, uint64_t runs,
+    const uint64_t *pmc)
+{
+	double	 n = runs ? (double)runs : 1.0;
+
+	out_printf(c, "%-16s %10llu %12.0f %12.0f %6.2f %10.1f\n", name,
+	    (unsigned long long)runs, (double)pmc[PMC_CYCLES] / n,
+	    (double)pmc[PMC_INSTRUCTIONS] / n, pmc[PMC_CYCLES] ?
+	    (double)pmc[PMC_INSTRUCTIONS] / (double)pmc[PMC_CYCLES] : 0.0,
+	    (double)pmc[PMC_CACHE_MISSES] / n);
+}
+
+
+/*
+ * job_profile copies class's counts out of the shared counters.
+ */
+static uint64_t
+job_profile(int class, uint64_t *pmc)
+{
+	int	 i;
+
+	for (i = 0; i < NPMC; i++) {
+		pmc[i] = atomic_load_explicit(&job_pmc[class][i],
+		    memory_order_relaxed);
+	}
+	return atomic_load_explicit(&job_pruns[class], memory_order_relaxed);
+}
+
+
+/*
+ * ctl_status replies with tables of operation latencies and of time
+ * spent in each event loop handler, in microseconds, tables of
+ * services and of pressure, and, if profiling has counted anything, a
+ * table of counts for each handler and job class.
+ */
+static void
+ctl_status(struct conn *c)
+{
+	static const double	 qs[] = {0.5, 0.9, 0.99, 0.999};
+	struct loopstat		*st;
+	struct hist		*h;
+	uint64_t		 runs, pmc[NPMC];
+	size_t			 i;
+	int			 op, class;
+
+	out_printf(c, "%-8s %10s %10s %10s %10s %10s %10s\n", "op", "count",
+	    "p50", "p90", "p99", "p99.9", "max");
+	for (op = 0; op < NOPS; op++) {
+		h = &hists[op];
+		out_printf(c, "%-8s %10llu", op_names[op],
+		    (unsigned long long)h->count);
+		for (i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+			out_printf(c, " %10.1f",
+			    (double)hist_quantile(h, qs[i]) / 1e3);
+		}
+		out_printf(c, " %10.1f\n", (double)h->max / 1e3);
+	}
+
+	out_printf(c, "\n%-16s %10s %10s %10s %10s\n", "handler", "runs",
+	    "mean", "max", "over");
+	for (st = loopstats; NULL != st; st = st->next) {
+		out_printf(c, "%-16s %10llu %10.1f %10.1f %10llu\n", st->name,
+		    (unsigned long long)st->runs, st->runs ?
+		    (double)st->ns / (double)st->runs / 1e3 : 0.0,
+		    (double)st->max / 1e3, (unsigned long long)st->over);
+	}
+
+	if (nservices > 0) {
+		out_printf(c, "\n%-16s %10s %10s %10s\n", "service", "pid",
+		    "restarts", "cpu%");
+	}
+	for (i = 0; i < nservices; i++) {
+		out_printf(c, "%-16s %10d %10llu %10.1f\n", services[i]->name,
+		    (int)services[i]->pid,
+		    (unsigned long long)services[i]->restarts,
+		    services[i]->cpu * 100);
+	}
+	if (nservices > 0) {
+		out_printf(c, "%zu starting, %zu queued, limit %zu\n",
+		    restarts_active, nrunq, restart_limit);
+	}
+
+	if (ntemplates > 0) {
+		out_printf(c, "\n%-16s %10s %10s %10s %10s\n", "template",
+		    "instances", "min", "max", "load");
+	}
+	for (i = 0; i < ntemplates; i++) {
+		out_printf(c, "%-16s %10zu %10zu %10zu %10.1f\n",
+		    templates[i]->name, templates[i]->want, templates[i]->min,
+		    templates[i]->max, templates[i]->load);
+	}
+
+	out_printf(c, "\n%-16s %10s\n", "pressure", "events");
+	for (i = 0; i < sizeof(psis) / sizeof(psis[0]); i++) {
+		out_printf(c, "%-16s %10llu\n", psis[i].resource,
+		    (unsigned long long)psis[i].events);
+	}
+	if (0 != pressure_until) {
+		out_printf(c, "background work paused\n");
+	}
+
+	for (st = loopstats; NULL != st && 0 == st->pruns; st = st->next) {
+		continue;
+	}
+	if (NULL == st) {
+		return;
+	}
+	out_printf(c, "\n%-16s %10s %12s %12s %6s %10s\n", "profile", "runs",
+	    "cycles", "instructions", "IPC", "misses");
+	for (st = loopstats; NULL != st; st = st->next) {
+		out_profile(c, st->name, st->pruns, st->pmc);
+	}
+	for (class = 0; class < NJOBCLASS; class++) {
+		runs = job_profile(class, pmc);
+		out_profile(c, class_names[class], runs, pmc);
+	}
+}
+
+
+/*
+ * ctl_metrics replies with operation latencies, as summaries, event
+ * loop handler times, service restarts, start queue depth and CPU use,
+ * pressure, and profiling counts per handler and job class, in the
+ * Prometheus text format.
+ */
+static void
+ctl_metrics(struct conn *c)
+{
+	static const char	*qs[] = {"0.5", "0.9", "0.99", "0.999"};
+	static const char	*pmc_names[NPMC] = {
+		"cycles", "instructions", "cache_misses"
+	};
+	struct loopstat		*st;
+	struct hist		*h;
+	uint64_t		 pmc[NPMC];
+	size_t			 i;
+	int			 op, class;
+
+	out_printf(c, "# TYPE persist_latency_seconds summary\n");
+	for (op = 0; op < NOPS; op++) {
+		h = &hists[op];
+		for (i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+			out_printf(c, "persist_latency_seconds{op=\"%s\","
+			    "quantile=\"%s\"} %.9f\n", op_names[op], qs[i],
+			    (double)hist_quantile(h, atof(qs[i])) / 1e9);
+		}
+		out_printf(c, "persist_latency_seconds_sum{op=\"%s\"} %.9f\n",
+		    op_names[op], (double)h->sum / 1e9);
+		out_printf(c, "persist_latency_seconds_count{op=\"%s\"} %llu\n",
+		    op_names[op], (unsigned long long)h->count);
+	}
+
+	out_printf(c, "# TYPE persist_latency_max_seconds gauge\n");
+	for (op = 0; op < NOPS; op++) {
+		out_printf(c, "persist_latency_max_seconds{op=\"%s\"} %.9f\n",
+		    op_names[op], (double)hists[op].max / 1e9);
+	}
+
+	out_printf(c, "# TYPE persist_loop_runs_total counter\n");
+	for (st = loopstats; NULL != st; st = st->next) {
+		out_printf(c, "persist_loop_runs_total{handler=\"%s\"} %llu\n",
+		    st->name, (unsigned long long)st->runs);
+	}
+	out_printf(c, "# TYPE persist_loop_seconds_total counter\n");
+	for (st = loopstats; NULL != st; st = st->next) {
+		out_printf(c, "persist_loop_seconds_total{handler=\"%s\"} "
+		    "%.9f\n", st->name, (double)st->ns / 1e9);
+	}
+	out_printf(c, "# TYPE persist_loop_max_seconds gauge\n");
+	for (st = loopstats; NULL != st; st = st->next) {
+		out_printf(c, "persist_loop_max_seconds{handler=\"%s\"} "
+		    "%.9f\n", st->name, (double)st->max / 1e9);
+	}
+	out_printf(c, "# TYPE persist_loop_overruns_total counter\n");
+	for (st = loopstats; NULL != st; st = st->next) {
+		out_printf(c, "persist_loop_overruns_total{handler=\"%s\"} "
+		    "%llu\n", st->name, (unsigned long long)st->over);
+	}
+
+	out_printf(c, "# TYPE persist_service_restarts_total counter\n");
+	for (i = 0; i < nservices; i++) {
+		out_printf(c, "persist_service_restarts_total{service=\"%s\"} "
+		    "%llu\n", services[i]->name,
+		    (unsigned long long)services[i]->restarts);
+	}
+	out_printf(c, "# TYPE persist_pressure_events_total counter\n");
+	for (i = 0; i < sizeof(psis) / sizeof(psis[0]); i++) {
+		out_printf(c, "persist_pressure_events_total{resource=\"%s\"} "
+		    "%llu\n", psis[i].resource,
+		    (unsigned long long)psis[i].events);
+	}
+	out_printf(c, "# TYPE persist_paused gauge\n");
+	out_printf(c, "persist_paused %d\n", 0 != pressure_until);
+	out_printf(c, "# TYPE persist_services_starting gauge\n");
+	out_printf(c, "persist_services_starting %zu\n", restarts_active);
+	out_printf(c, "# TYPE persist_services_queued gauge\n");
+	out_printf(c, "persist_services_queued %zu\n", nrunq);
+	out_printf(c, "# TYPE persist_service_cpu_ratio gauge\n");
+	for (i = 0; i < nservices; i++) {
+		out_printf(c, "persist_service_cpu_ratio{service=\"%s\"} "
+		    "%.3f\n", services[i]->name, services[i]->cpu);
+	}
+	out_printf(c, "# TYPE persist_service_queue gauge\n");
+	for (i = 0; i < nservices; i++) {
+		out_printf(c, "persist_service_queue{service=\"%s\"} %llu\n",
+		    services[i]->name, (unsigned long long)services[i]->queue);
+	}
+	out_printf(c, "# TYPE persist_template_instances gauge\n");
+	for (i = 0; i < ntemplates; i++) {
+		out_printf(c, "persist_template_instances{template=\"%s\"} "
+		    "%zu\n", templates[i]->name, templates[i]->want);
+	}
+
+	out_printf(c, "# TYPE persist_profiled_runs_total counter\n");
+	for (st = loopstats; NULL != st; st = st->next) {
+		out_printf(c, "persist_profiled_runs_total{handler=\"%s\"} "
+		    "%llu\n", st->name, (unsigned long long)st->pruns);
+	}
+	for (class = 0; class < NJOBCLASS; class++) {
+		out_printf(c, "persist_profiled_runs_total{job=\"%s\"} %llu\n",
+		    class_names[class],
+		    (unsigned long long)job_profile(class, pmc));
+	}
+	for (i = 0; i < NPMC; i++) {
+		out_printf(c, "# TYPE persist_%s_total counter\n",
+		    pmc_names[i]);
+		for (st = loopstats; NULL != st; st = st->next) {
+			out_printf(c, "persist_%s_total{handler=\"%s\"} %llu\n",
+			    pmc_names[i], st->name,
+			    (unsigned long long)st->pmc[i]);
+		}
+		for (class = 0; class < NJOBCLASS; class++) {
+			job_profile(class, pmc);
+			out_printf(c, "persist_%s_total{job=\"%s\"} %llu\n",
+			    pmc_names[i], class_names[class],
+			    (unsigned long long)pmc[i]);
+		}
+	}
+}
+
+
+/*
+ * out_json appends s to c's reply as a JSON string.
+ */
+static void
+out_json(struct conn *c, const char *s)
+{
+	out_printf(c, "\"");
+	for (; *s; s++) {
+		if ('"' == *s || '\\' == *s) {
+			out_printf(c, "\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			out_printf(c, "\\u%04x", (unsigned char)*s);
+		} else {
+			out_printf(c, "%c", *s);
+		}
+	}
+	out_printf(c, "\"");
+}
+
+
+/*
+ * out_span appends sp to c's reply as a Chrome trace event.
+ */
+static void
+out_span(struct conn *c, const struct span *sp, pid_t me, long tid)
+{
+	out_printf(c, "\n{\"name\":\"%s\",\"cat\":\"persist\",\"ph\":\"X\","
+	    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld", sp->name,
+	    (double)sp->start / 1e3, (double)(sp->end - sp->start) / 1e3,
+	    (int)me, tid);
+	if (NULL != sp->arg) {
+		out_printf(c, ",\"args\":{\"path\":");
+		out_json(c, sp->arg);
+		out_printf(c, "}");
+	}
+	out_printf(c, "}");
+}
+
+
+/*
+ * ctl_trace replies with every thread's recorded spans in the Chrome
+ * trace event format, which chrome://tracing and Perfetto open. Spans
+ * overwritten while this runs are left out.
+ */
+static void
+ctl_trace(struct conn *c)
+{
+	struct tracebuf	*b;
+	struct span	*sp, copy;
+	uint64_t	 head, i, seq;
+	pid_t		 me = getpid();
+	const char	*sep = "";
+
+	out_printf(c, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (b = atomic_load(&tracebufs); NULL != b; b = b->next) {
+		out_printf(c, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\","
+		    "\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+		    sep, (int)me, b->tid,
+		    0 == b->tid ? "event loop" : "worker");
+		sep = ",";
+
+		head = atomic_load_explicit(&b->head, memory_order_acquire);
+		i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+		for (; i < head; i++) {
+			sp = &b->spans[i % TRACE_EVENTS];
+			seq = atomic_load_explicit(&sp->seq,
+			    memory_order_acquire);
+			copy.name = sp->name;
+			copy.arg = sp->arg;
+			copy.start = sp->start;
+			copy.end = sp->end;
+			atomic_thread_fence(memory_order_acquire);
+			if (seq != 2 * i + 2 || seq != atomic_load_explicit(
+			    &sp->seq, memory_order_relaxed)) {
+				continue;
+			}
+
+			out_printf(c, ",");
+			out_span(c, &copy, me, b->tid);
+		}
+	}
+	out_printf(c, "\n]}\n");
+}
+
+
+static void	svc_stop_all(void);
+static void	tmpl_scale(struct template *, size_t);
+static void	tmpl_autoscale(void *);
+
+
+/*
+ * ctl_scale runs "scale NAME N". N can't be over TMPL_MAX_INSTANCES,
+ * or outside an autoscaled template's bounds.
+ */
+static void
+ctl_scale(struct conn *c, char *args)
+{
+	struct template	*t;
+	char		*name, *num, *last;
+	unsigned long	 n;
+
+	name = strtok_r(args, " ", &last);
+	num = strtok_r(NULL, " ", &last);
+	if (NULL == name || NULL == num ||
+	    NULL != strtok_r(NULL, " ", &last)) {
+		out_printf(c, "usage: scale NAME N\n");
+		return;
+	}
+	if (NULL == (t = tmpl_find(name))) {
+		out_printf(c, "no template %s\n", name);
+		return;
+	}
+
+	errno = 0;
+	n = strtoul(num, NULL, 10);
+	if (strspn(num, "0123456789") != strlen(num) || ERANGE == errno ||
+	    n > TMPL_MAX_INSTANCES ||
+	    (t->min < t->max && (n < t->min || n > t->max))) {
+		out_printf(c, "%s can't run %s instances\n", name, num);
+		return;
+	}
+	if (stopping) {
+		out_printf(c, "shutting down\n");
+		return;
+	}
+
+	tmpl_scale(t, n);
+	out_printf(c, "%s: %lu instances\n", name, n);
+}
+
+
+/*
+ * ctl_command runs the command line in c->in.
+ */
+static void
+ctl_command(struct conn *c)
+{
+	hist_merge();
+
+	if (0 == strcmp(c->in, "status")) {
+		ctl_status(c);
+	} else if (0 == strcmp(c->in, "metrics")) {
+		ctl_metrics(c);
+	} else if (0 == strcmp(c->in, "trace on")) {
+		atomic_store(&trace_on, 1);
+		out_printf(c, "tracing\n");
+	} else if (0 == strcmp(c->in, "trace off")) {
+		atomic_store(&trace_on, 0);
+		out_printf(c, "not tracing\n");
+	} else if (0 == strcmp(c->in, "trace")) {
+		ctl_trace(c);
+	} else if (0 == strcmp(c->in, "profile on")) {
+		atomic_store(&profile_on, 1);
+		out_printf(c, "profiling\n");
+	} else if (0 == strcmp(c->in, "profile off")) {
+		atomic_store(&profile_on, 0);
+		out_printf(c, "not profiling\n");
+	} else if (0 == strcmp(c->in, "stop")) {
+		svc_stop_all();
+		out_printf(c, "stopping\n");
+	} else if (0 == strncmp(c->in, "scale ", 6)) {
+		ctl_scale(c, c->in + 6);
+	} else {
+		out_printf(c, "unknown command: %s\n", c->in);
+	}
+}
+
+
+static void
+ctl_close(struct conn *c)
+{
+	del_handler(&c->h);
+	free(c->out);
+	free(c);
+}
+
+
+/*
+ * ctl_io reads a control client's command, then writes the reply as
+ * the socket takes it, and hangs up.
+ */
+static void
+ctl_io(struct handler *h)
+{
+	struct conn		*c = (struct conn *)h;
+	struct epoll_event	 ev;
+	char			*nl;
+	ssize_t			 n;
+
+	if (NULL == c->out) {
+		n = read(h->fd, c->in + c->inlen, sizeof(c->in) - 1 - c->inlen);
+		if (-1 == n && EAGAIN == errno) {
+			return;
+		}
+		if (n <= 0) {
+			ctl_close(c);
+			return;
+		}
+		c->inlen += (size_t)n;
+		c->in[c->inlen] = 0;
+		if (NULL == (nl = strchr(c->in, '\n')) &&
+		    c->inlen < sizeof(c->in) - 1) {
+			return;
+		}
+		if (NULL != nl) {
+			*nl = 0;
+		}
+
+		ctl_command(c);
+		if (NULL == c->out) {
+			ctl_close(c);
+			return;
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLOUT;
+		ev.data.ptr = h;
+		epoll_ctl(epfd, EPOLL_CTL_MOD, h->fd, &ev);
+	}
+
+	while (c->outoff < c->outlen) {
+		n = write(h->fd, c->out + c->outoff, c->outlen - c->outoff);
+		if (-1 == n && EAGAIN == errno) {
+			return;
+		}
+		if (n <= 0) {
+			break;
+		}
+		c->outoff += (size_t)n;
+	}
+	ctl_close(c);
+}
+
+
+/*
+ * ctl_accept takes new control clients onto the event loop.
+ */
+static void
+ctl_accept(struct handler *h)
+{
+	static struct loopstat	 clients = {.name = "control client"};
+	struct conn		*c;
+	int			 fd;
+
+	while (-1 != (fd = accept4(h->fd, NULL, NULL,
+	    SOCK_NONBLOCK|SOCK_CLOEXEC))) {
+		if (NULL == (c = calloc(1, sizeof(*c)))) {
+			close(fd);
+			continue;
+		}
+		c->h.fd = fd;
+		c->h.name = "control client";
+		c->h.fn = ctl_io;
+		c->h.stat = &clients;
+		add_handler(&c->h);
+	}
+}
+
+
+/*
+ * ctl_init opens the control socket. persist runs without one if it
+ * can't.
+ */
+static int
+ctl_init(void)
+{
+	struct sockaddr_un	 sun;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, CONTROL_SOCKET, sizeof(sun.sun_path) - 1);
+
+	ctl_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (-1 == ctl_fd) {
+		warn("couldn't open control socket");
+		return -1;
+	}
+
+	unlink(CONTROL_SOCKET);
+	if (-1 == bind(ctl_fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+	    -1 == chmod(CONTROL_SOCKET, 0600) || -1 == listen(ctl_fd, 16)) {
+		warn("couldn't open control socket %s", CONTROL_SOCKET);
+		close(ctl_fd);
+		ctl_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * ctl_client sends cmd to a running watcher and prints its reply.
+ */
+static int
+ctl_client(const char *cmd)
+{
+	struct sockaddr_un	 sun;
+	char			 buf[4096];
+	ssize_t			 n;
+	int			 fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, CONTROL_SOCKET, sizeof(sun.sun_path) - 1);
+
+	if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) ||
+	    -1 == connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+		err(EXIT_FAILURE, "couldn't reach persist at %s",
+		    CONTROL_SOCKET);
+	}
+
+	if (-1 == write(fd, cmd, strlen(cmd)) || -1 == write(fd, "\n", 1)) {
+		err(EXIT_FAILURE, "couldn't send %s", cmd);
+	}
+	shutdown(fd, SHUT_WR);
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		if (-1 == write(STDOUT_FILENO, buf, (size_t)n)) {
+			err(EXIT_FAILURE, "couldn't print reply");
+		}
+	}
+
+	close(fd);
+	return EXIT_SUCCESS;
+}
+
+
+/*
+ * sim_log prints what happened under simulation, at the virtual time
+ * it happened.
+ */
+static void
+sim_log(const char *fmt, ...)
+{
+	va_list	 ap;
+
+	printf("%12.3f  ", (double)sim_clock / 1e9);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+}
+
+
+static void	svc_retry(void *);
+static void	svc_later(struct service *);
+static void	svc_settled(void *);
+static void	svc_gone(void *);
+static void	svc_exited(struct handler *);
+
+
+/*
+ * cg_write writes val to one of s's cgroup files.
+ */
+static int
+cg_write(struct service *s, const char *file, const char *val)
+{
+	ssize_t	 n;
+	int	 fd;
+
+	if (-1 == (fd = openat(s->cg, file, O_WRONLY|O_CLOEXEC))) {
+		return -1;
+	}
+	n = write(fd, val, strlen(val));
+	close(fd);
+	return (ssize_t)strlen(val) == n ? 0 : -1;
+}
+
+
+/*
+ * cg_populated says whether anything is still running in s's cgroup.
+ */
+static int
+cg_populated(struct service *s)
+{
+	char	 buf[256];
+	ssize_t	 n;
+	int	 fd;
+
+	if (-1 == (fd = openat(s->cg, "cgroup.events", O_RDONLY|O_CLOEXEC))) {
+		return 0;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return 0;
+	}
+	buf[n] = 0;
+	return NULL != strstr(buf, "populated 1");
+}
+
+
+/*
+ * cg_cpu reads the CPU time, in nanoseconds, used by everything that's
+ * run in s's cgroup, or returns -1 if it can't.
+ */
+static int
+cg_cpu(struct service *s, uint64_t *ns)
+{
+	char	 buf[512], *usage;
+	ssize_t	 n;
+	int	 fd;
+
+	if (-1 == s->cg ||
+	    -1 == (fd = openat(s->cg, "cpu.stat", O_RDONLY|O_CLOEXEC))) {
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return -1;
+	}
+	buf[n] = 0;
+	if (NULL == (usage = strstr(buf, "usage_usec "))) {
+		return -1;
+	}
+	*ns = strtoull(usage + 11, NULL, 10) * 1000;
+	return 0;
+}
+
+
+/*
+ * cg_make makes s's cgroup, if it isn't there already, and watches its
+ * cgroup.events. If it can't, s goes without.
+ */
+static int
+cg_make(struct service *s)
+{
+	struct service	**bywd;
+	int		  wd;
+
+	if ((-1 == mkdir(s->cg_path, 0755) && EEXIST != errno) ||
+	    -1 == (s->cg = open(s->cg_path, O_RDONLY|O_DIRECTORY|O_CLOEXEC))) {
+		warn("couldn't make a cgroup for %s", s->name);
+		s->cg = -1;
+		return -1;
+	}
+	wd = inotify_add_watch(cg_ifd, arena_cat(s->cg_path, "/cgroup.events",
+	    NULL), IN_MODIFY);
+	if (-1 == wd) {
+		warn("couldn't watch %s's cgroup", s->name);
+		close(s->cg);
+		s->cg = -1;
+		return -1;
+	}
+
+	if ((size_t)wd >= cg_nwd) {
+		bywd = reallocarray(cg_bywd, (size_t)wd + 1, sizeof(*cg_bywd));
+		if (NULL == bywd) {
+			err(EXIT_FAILURE, "out of memory");
+		}
+		memset(bywd + cg_nwd, 0,
+		    ((size_t)wd + 1 - cg_nwd) * sizeof(*bywd));
+		cg_bywd = bywd;
+		cg_nwd = (size_t)wd + 1;
+	}
+	cg_bywd[wd] = s;
+	s->cg_wd = wd;
+	return 0;
+}
+
+
+/*
+ * cg_add gives s a cgroup, persist.NAME, under cg_root. One left empty
+ * by an earlier run is made afresh, since it may have been killed.
+ */
+static void
+cg_add(struct service *s)
+{
+	s->cg_path = strdup(arena_cat(cg_root, "/persist.", s->name, NULL));
+	if (NULL == s->cg_path) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	rmdir(s->cg_path);
+	cg_make(s);
+}
+
+
+/*
+ * cg_renew swaps s's cgroup for a fresh one, once it's empty. Some
+ * kernels go on killing anything cloned straight into a cgroup that's
+ * ever been through cgroup.kill.
+ */
+static int
+cg_renew(struct service *s)
+{
+	if (-1 == rmdir(s->cg_path)) {
+		return -1;
+	}
+	cg_bywd[s->cg_wd] = NULL;
+	close(s->cg);
+	s->cg_killed = 0;
+	return cg_make(s);
+}
+
+
+/*
+ * svc_kill kills everything in s at once, through cgroup.kill, or just
+ * its main process if it has no cgroup.
+ */
+static void
+svc_kill(struct service *s)
+{
+	if (-1 != s->cg && 0 == cg_write(s, "cgroup.kill", "1")) {
+		s->cg_killed = 1;
+		return;
+	}
+	if (-1 != s->h.fd) {
+		syscall(SYS_pidfd_send_signal, s->h.fd, SIGKILL, NULL, 0);
+	}
+}
+
+
+#ifndef POSIX_SPAWN_SETCGROUP
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP	0x200000000ULL
+#endif
+
+/* The kernel's struct clone_args, as of CLONE_INTO_CGROUP. */
+struct cg_clone {
+	uint64_t	 flags;
+	uint64_t	 pidfd;
+	uint64_t	 child_tid;
+	uint64_t	 parent_tid;
+	uint64_t	 exit_signal;
+	uint64_t	 stack;
+	uint64_t	 stack_size;
+	uint64_t	 tls;
+	uint64_t	 set_tid;
+	uint64_t	 set_tid_size;
+	uint64_t	 cgroup;
+};
+
+
+/*
+ * cg_spawn forks s straight into its cgroup and runs it there, for C
+ * libraries whose posix_spawn can't. It returns 0, or an error number
+ * like posix_spawn's, or -1 if the kernel can't do it either. An exec
+ * failure comes back from the child over a pipe.
+ */
+static int
+cg_spawn(struct service *s)
+{
+	struct cg_clone	 args;
+	sigset_t	 none;
+	long		 p;
+	int		 fds[2], e;
+
+	if (-1 == pipe2(fds, O_CLOEXEC)) {
+		return errno;
+	}
+	memset(&args, 0, sizeof(args));
+	args.flags = CLONE_INTO_CGROUP;
+	args.exit_signal = SIGCHLD;
+	args.cgroup = (uint64_t)s->cg;
+	sigemptyset(&none);
+
+	if (0 == (p = syscall(SYS_clone3, &args, sizeof(args)))) {
+		/* Only async-signal-safe calls from here. */
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		execve(s->argv[0], s->argv, environ);
+		e = errno;
+		write(fds[1], &e, sizeof(e));
+		_exit(127);
+	}
+	close(fds[1]);
+
+	if (-1 == p) {
+		close(fds[0]);
+		return -1;
+	}
+	if ((ssize_t)sizeof(e) == read(fds[0], &e, sizeof(e))) {
+		waitpid((pid_t)p, NULL, 0);
+	} else {
+		e = 0;
+		s->pid = (pid_t)p;
+	}
+	close(fds[0]);
+	return e;
+}
+#endif
+
+
+/*
+ * svc_spawn runs s, in its cgroup if it has one, without the signals
+ * the watcher blocks. If it can't be started straight into its cgroup,
+ * it's moved there once it's running, and anything it forks first
+ * escapes.
+ */
+static int
+svc_spawn(struct service *s)
+{
+	posix_spawnattr_t	 attr;
+	sigset_t		 none;
+	short			 flags = POSIX_SPAWN_SETSIGMASK;
+	int			 rc;
+
+#ifndef POSIX_SPAWN_SETCGROUP
+	if (-1 != s->cg && (!s->cg_killed || 0 == cg_renew(s)) &&
+	    -1 != (rc = cg_spawn(s))) {
+		return rc;
+	}
+#endif
+	sigemptyset(&none);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+#ifdef POSIX_SPAWN_SETCGROUP
+	if (-1 != s->cg) {
+		flags |= POSIX_SPAWN_SETCGROUP;
+		posix_spawnattr_setcgroup_np(&attr, s->cg);
+	}
+#endif
+	posix_spawnattr_setflags(&attr, flags);
+	rc = posix_spawn(&s->pid, s->argv[0], NULL, &attr, s->argv, environ);
+	posix_spawnattr_destroy(&attr);
+#ifndef POSIX_SPAWN_SETCGROUP
+	if (0 == rc && -1 != s->cg &&
+	    -1 == cg_write(s, "cgroup.procs", utoa((unsigned long)s->pid))) {
+		warn("couldn't move %s into its cgroup", s->name);
+	}
+#endif
+	return rc;
+}
+
+
+/*
+ * svc_release gives up s's start slot, if it holds one.
+ */
+static void
+svc_release(struct service *s)
+{
+	if (s->starting) {
+		s->starting = 0;
+		restarts_active--;
+	}
+}
+
+
+/*
+ * svc_start spawns s and watches for it to exit, holding its start slot
+ * until it settles. If it can't be started, it backs off and is queued
+ * again later. Under simulation nothing is spawned; s gets a made-up
+ * pid, and exits when the script says.
+ */
+static void
+svc_start(struct service *s)
+{
+	static struct loopstat	 svc_stat = {.name = "services"};
+	static pid_t		 sim_pid = 1;
+	uint64_t		 ns;
+	int			 fd;
+
+	if (sim) {
+		if (s->fail > 0) {
+			s->fail--;
+			sim_log("%s failed to start", s->name);
+			svc_release(s);
+			svc_later(s);
+			return;
+		}
+		s->pid = ++sim_pid;
+		sim_log("%s started as %d", s->name, (int)s->pid);
+	} else {
+		if (-1 != s->cg && cg_populated(s)) {
+			/* Strays from an earlier run. */
+			svc_kill(s);
+		}
+		if (0 != svc_spawn(s)) {
+			warn("couldn't start %s", s->name);
+			s->pid = 0;
+			svc_release(s);
+			svc_later(s);
+			return;
+		}
+
+		if (-1 == (fd = (int)syscall(SYS_pidfd_open, s->pid, 0))) {
+			err(EXIT_FAILURE, "couldn't watch %s", s->name);
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		s->h.fd = fd;
+		s->h.name = s->name;
+		s->h.fn = svc_exited;
+		s->h.stat = &svc_stat;
+		add_handler(&s->h);
+	}
+
+	/*
+	 * A restart is timed to here from when it was due, however many
+	 * tries it took.
+	 */
+	s->started = now_ns();
+	if (0 != s->died) {
+		ns = op_done(OP_RESTART, s->died, s->name);
+		PROBE3(spawn, 1 + s->idx, s->pid, ns);
+		s->died = 0;
+	}
+	s->settle_due = now_ns() + SVC_SETTLE_MS * MSEC;
+	timer_add(s->settle_due, svc_settled, s);
+}
+
+
+/*
+ * svc_ready says whether s may start: everything it comes after has to
+ * be up and settled, bar instances that have been retired.
+ */
+static int
+svc_ready(const struct service *s)
+{
+	size_t	 i;
+
+	for (i = 0; i < s->nafter; i++) {
+		if (s->after[i]->retired) {
+			continue;
+		}
+		if (0 == s->after[i]->pid || s->after[i]->starting) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * svc_dispatch starts queued services, in priority order, while there
+ * are slots free, and persist isn't shutting down. Services that are
+ * waiting on others are passed over, as are all but critical services
+ * under pressure. Instances retired while queued are dropped.
+ */
+static void
+svc_dispatch(void)
+{
+	struct service	*s;
+	size_t		 i = 0;
+
+	while (!stopping && i < nrunq && restarts_active < restart_limit) {
+		s = runq[i];
+		if (!s->retired && (!svc_ready(s) ||
+		    (0 != pressure_until && !s->critical))) {
+			i++;
+			continue;
+		}
+		memmove(&runq[i], &runq[i + 1],
+		    (nrunq - i - 1) * sizeof(*runq));
+		nrunq--;
+		s->queued = 0;
+		if (s->retired) {
+			continue;
+		}
+		s->starting = 1;
+		restarts_active++;
+		svc_start(s);
+	}
+}
+
+
+/*
+ * svc_queue queues s to start, behind anything of the same or higher
+ * priority, and starts what it can. A service that's still running,
+ * say an instance being stopped, is queued by svc_died once it's gone.
+ */
+static void
+svc_queue(struct service *s)
+{
+	size_t	 lo = 0, hi = nrunq, mid;
+
+	if (s->queued || s->retired || 0 != s->pid) {
+		return;
+	}
+	if (nrunq == runqcap) {
+		runqcap = runqcap ? runqcap * 2 : 64;
+		runq = reallocarray(runq, runqcap, sizeof(*runq));
+		if (NULL == runq) {
+			err(EXIT_FAILURE, "out of memory");
+		}
+	}
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (runq[mid]->priority <= s->priority) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	memmove(&runq[lo + 1], &runq[lo], (nrunq - lo) * sizeof(*runq));
+	runq[lo] = s;
+	nrunq++;
+	s->queued = 1;
+	svc_dispatch();
+}
+
+
+/*
+ * svc_later queues s to start once its backoff is up, and doubles the
+ * backoff for next time.
+ */
+static void
+svc_later(struct service *s)
+{
+	if (0 == s->backoff) {
+		s->backoff = SVC_RETRY_MS * MSEC;
+	}
+	s->retry_due = now_ns() + s->backoff;
+	timer_add(s->retry_due, svc_retry, s);
+	if (sim) {
+		sim_log("%s backing off %llu ms", s->name,
+		    (unsigned long long)(s->backoff / MSEC));
+	}
+
+	s->backoff *= 2;
+	if (s->backoff > SVC_BACKOFF_MAX_MS * MSEC) {
+		s->backoff = SVC_BACKOFF_MAX_MS * MSEC;
+	}
+}
+
+
+/*
+ * svc_retry is svc_later's timer. One left over from an earlier
+ * backoff is ignored.
+ */
+static void
+svc_retry(void *arg)
+{
+	struct service	*s = arg;
+
+	if (s->retry_due > now_ns()) {
+		return;
+	}
+	svc_queue(s);
+}
+
+
+/*
+ * svc_settled frees s's start slot once it's been up long enough. A
+ * timer left over from an earlier start is ignored.
+ */
+static void
+svc_settled(void *arg)
+{
+	struct service	*s = arg;
+
+	if (!s->starting || s->settle_due > now_ns()) {
+		return;
+	}
+	svc_release(s);
+	svc_dispatch();
+}
+
+
+/*
+ * svc_signal sends sig to s: to its main process, or if that's gone,
+ * to everything left in its cgroup. Under simulation, a service exits
+ * on any signal, unless it's been scripted to hang and the signal can
+ * be ignored.
+ */
+static void
+svc_signal(struct service *s, int sig)
+{
+	FILE	*f;
+	int	 fd;
+	long	 p;
+
+	if (sim) {
+		sim_log("sent %s signal %d", s->name, sig);
+		if (!s->hang || SIGKILL == sig) {
+			timer_add(now_ns(), svc_gone, s);
+		}
+		return;
+	}
+
+	if (-1 != s->h.fd) {
+		syscall(SYS_pidfd_send_signal, s->h.fd, sig, NULL, 0);
+		return;
+	}
+	if (-1 == s->cg ||
+	    -1 == (fd = openat(s->cg, "cgroup.procs", O_RDONLY|O_CLOEXEC))) {
+		return;
+	}
+	if (NULL == (f = fdopen(fd, "r"))) {
+		close(fd);
+		return;
+	}
+	while (1 == fscanf(f, "%ld", &p)) {
+		kill((pid_t)p, sig);
+	}
+	fclose(f);
+}
+
+
+/*
+ * svc_escalate kills s if it's still running when its stop timeout
+ * runs out. A timer left over from an earlier stop is ignored.
+ */
+static void
+svc_escalate(void *arg)
+{
+	struct service	*s = arg;
+
+	if (0 == s->pid || !s->stopping || s->stop_due > now_ns()) {
+		return;
+	}
+	if (sim) {
+		sim_log("%s didn't stop; killing it", s->name);
+		svc_signal(s, SIGKILL);
+	} else {
+		syslog(LOG_WARNING, "%s didn't stop; killing it", s->name);
+		svc_kill(s);
+	}
+}
+
+
+/*
+ * svc_stop asks s to stop, and has it killed if it doesn't in time.
+ */
+static void
+svc_stop(struct service *s)
+{
+	if (0 == s->pid || s->stopping) {
+		return;
+	}
+	s->stopping = 1;
+	s->stop_due = now_ns() + s->stop_timeout;
+	svc_signal(s, s->stop_signal);
+	timer_add(s->stop_due, svc_escalate, s);
+}
+
+
+/*
+ * svc_stopped counts s as stopped while persist shuts down, stopping
+ * anything that was only waiting on it, and ends the loop once the last
+ * service is gone.
+ */
+static void
+svc_stopped(struct service *s)
+{
+	size_t	 i;
+
+	if (sim) {
+		sim_log("%s stopped", s->name);
+	}
+	for (i = 0; i < s->nafter; i++) {
+		if (0 == --s->after[i]->holders) {
+			svc_stop(s->after[i]);
+		}
+	}
+	if (0 == --nstopping) {
+		loop_done = 1;
+	}
+}
+
+
+/*
+ * svc_died queues s to start again after it's exited, unless persist
+ * is shutting down or s has been retired. If it stayed up, that's
+ * straight away, and it's forgiven any backoff; if not, it backs off.
+ * The restart is timed from when the loop woke to the exit, or from
+ * when the backoff is up.
+ */
+static void
+svc_died(struct service *s)
+{
+	PROBE3(exit, 1 + s->idx, s->pid, now_ns() - loop_woke);
+	svc_release(s);
+	s->pid = 0;
+	s->stopping = 0;
+	if (stopping) {
+		svc_stopped(s);
+		return;
+	}
+	if (s->retired) {
+		if (sim) {
+			sim_log("%s retired", s->name);
+		}
+		return;
+	}
+	s->restarts++;
+	if (loop_woke - s->started >= SVC_STABLE_MS * MSEC) {
+		s->backoff = 0;
+	}
+	if (0 == s->backoff) {
+		s->died = loop_woke;
+		s->backoff = SVC_RETRY_MS * MSEC;
+		svc_queue(s);
+		return;
+	}
+	s->died = loop_woke + s->backoff;
+	svc_later(s);
+}
+
+
+/*
+ * svc_gone is svc_died as a timer.
+ */
+static void
+svc_gone(void *arg)
+{
+	struct service	*s = arg;
+
+	if (0 != s->pid) {
+		svc_died(s);
+	}
+}
+
+
+/*
+ * svc_exited reaps a service's main process. The service has died if
+ * that was the last thing in its cgroup; otherwise it's left to
+ * cg_event to notice when the rest go.
+ */
+static void
+svc_exited(struct handler *h)
+{
+	struct service	*s = (struct service *)h;
+
+	waitpid(s->pid, NULL, WNOHANG);
+	del_handler(h);
+	if (-1 == s->cg || !cg_populated(s)) {
+		svc_died(s);
+	}
+}
+
+
+/*
+ * cg_gone checks whether s, whose main process has been reaped, has
+ * now emptied its cgroup.
+ */
+static void
+cg_gone(struct service *s)
+{
+	if (0 != s->pid && -1 == s->h.fd && !cg_populated(s)) {
+		svc_died(s);
+	}
+}
+
+
+/*
+ * cg_event handles changes to services' cgroup.events. If events were
+ * lost, every service is checked.
+ */
+static void
+cg_event(struct handler *h)
+{
+	struct inotify_event	*ev;
+	char			 buf[4096]
+				    __attribute__((aligned(__alignof__(*ev))));
+	ssize_t			 n, off;
+	size_t			 i;
+
+	while ((n = read(h->fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *)(buf + off);
+			if (ev->mask & IN_Q_OVERFLOW) {
+				for (i = 0; i < nservices; i++) {
+					cg_gone(services[i]);
+				}
+			} else if (ev->wd >= 0 && (size_t)ev->wd < cg_nwd &&
+			    NULL != cg_bywd[ev->wd]) {
+				cg_gone(cg_bywd[ev->wd]);
+			}
+		}
+	}
+}
+
+
+/*
+ * cg_base returns the cgroup v2 directory persist is running in, in
+ * scratch memory, or NULL if there's no unified hierarchy.
+ */
+static char *
+cg_base(void)
+{
+	struct mntent	*m;
+	FILE		*f;
+	char		*mnt = NULL, *base = NULL, *line = NULL;
+	size_t		 linecap = 0;
+
+	if (NULL == (f = setmntent("/proc/self/mounts", "re"))) {
+		return NULL;
+	}
+	while (NULL == mnt && NULL != (m = getmntent(f))) {
+		if (0 == strcmp(m->mnt_type, "cgroup2")) {
+			mnt = arena_cat(m->mnt_dir, NULL);
+			cg_mntlen = strlen(mnt);
+		}
+	}
+	endmntent(f);
+
+	if (NULL == mnt || NULL == (f = fopen("/proc/self/cgroup", "re"))) {
+		return NULL;
+	}
+	while (NULL == base && -1 != getline(&line, &linecap, f)) {
+		if (0 == strncmp(line, "0::", 3)) {
+			line[strcspn(line, "\n")] = 0;
+			/* In the root cgroup, that's the mount point. */
+			base = arena_cat(mnt, 0 == strcmp(line + 3, "/") ? "" :
+			    line + 3, NULL);
+		}
+	}
+	free(line);
+	fclose(f);
+	return base;
+}
+
+
+/*
+ * cg_init gives each service a cgroup under persist's own, and watches
+ * its cgroup.events. Services without one, because there's no cgroup
+ * v2 or persist can't make them, fall back to watching their main
+ * process.
+ */
+static void
+cg_init(void)
+{
+	static struct loopstat	 cg_stat = {.name = "cgroups"};
+	static struct handler	 cg = {-1, "cgroups", cg_event, &cg_stat, 0};
+	char			*base;
+	size_t			 i;
+
+	if ((0 == nservices && 0 == ntemplates) || NULL == (base = cg_base())) {
+		return;
+	}
+	if (NULL == (cg_root = strdup(base))) {
+		err(EXIT_FAILURE, "out of memory");
+	}
+	if (-1 == (cg_ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC))) {
+		warn("couldn't watch cgroups");
+		return;
+	}
+
+	for (i = 0; i < nservices; i++) {
+		cg_add(services[i]);
+	}
+
+	cg.fd = cg_ifd;
+	add_handler(&cg);
+}
+
+
+/*
+ * psi_check ends pressure once it's gone PSI_HOLD_MS without a trigger
+ * firing, resuming the pool and starting anything that was held back.
+ */
+static void
+psi_check(void *arg)
+{
+	(void)arg;
+
+	if (0 == pressure_until) {
+		return;
+	}
+	if (pressure_until > now_ns()) {
+		timer_add(pressure_until, psi_check, NULL);
+		return;
+	}
+
+	pressure_until = 0;
+	if (sim) {
+		sim_log("pressure eased");
+	} else {
+		syslog(LOG_NOTICE, "pressure eased; resuming");
+	}
+	pool_pause(0);
+	svc_dispatch();
+}
+
+
+/*
+ * psi_fire records p's trigger firing, pausing background work if this
+ * starts a spell of pressure.
+ */
+static void
+psi_fire(struct psi *p)
+{
+	int	 start = 0 == pressure_until;
+
+	p->events++;
+	pressure_until = now_ns() + PSI_HOLD_MS * MSEC;
+	if (!start) {
+		return;
+	}
+
+	if (sim) {
+		sim_log("%s pressure", p->resource);
+	} else {
+		syslog(LOG_WARNING, "%s pressure; pausing background work",
+		    p->resource);
+	}
+	pool_pause(1);
+	timer_add(pressure_until, psi_check, NULL);
+}
+
+
+static void
+psi_event(struct handler *h)
+{
+	psi_fire((struct psi *)h);
+}
+
+
+/*
+ * psi_init sets up a trigger for each kind of pressure. A kernel without
+ * PSI, or one that won't take the trigger, just goes without.
+ */
+static void
+psi_init(void)
+{
+	static struct loopstat	 psi_stat = {.name = "pressure"};
+	char			 trigger[64];
+	size_t			 i;
+	int			 fd, len;
+
+	len = snprintf(trigger, sizeof(trigger), "some %llu %llu",
+	    (unsigned long long)PSI_STALL_MS * 1000,
+	    (unsigned long long)PSI_WINDOW_MS * 1000);
+	for (i = 0; i < sizeof(psis) / sizeof(psis[0]); i++) {
+		fd = open(arena_cat("/proc/pressure/", psis[i].resource, NULL),
+		    O_RDWR|O_NONBLOCK|O_CLOEXEC);
+		if (-1 == fd) {
+			continue;
+		}
+		if (len + 1 != write(fd, trigger, (size_t)len + 1)) {
+			warn("couldn't watch %s pressure", psis[i].resource);
+			close(fd);
+			continue;
+		}
+		psis[i].h.fd = fd;
+		psis[i].h.name = psis[i].resource;
+		psis[i].h.fn = psi_event;
+		psis[i].h.stat = &psi_stat;
+		psis[i].h.events = EPOLLPRI;
+		add_handler(&psis[i].h);
+	}
+}
+
+
+/*
+ * svc_cycle looks for a dependency cycle through s, depth first, and
+ * breaks any it finds by dropping the edge that closes it.
+ */
+static void
+svc_cycle(struct service *s)
+{
+	size_t	 i;
+
+	s->visiting = 1;
+	for (i = 0; i < s->nafter; ) {
+		if (1 == s->after[i]->visiting) {
+			warnx("%s can't come after %s: that's a cycle",
+			    s->name, s->after[i]->name);
+			s->after[i] = s->after[--s->nafter];
+			continue;
+		}
+		if (0 == s->after[i]->visiting) {
+			svc_cycle(s->after[i]);
+		}
+		i++;
+	}
+	s->visiting = 2;
+}
+
+
+/*
+ * svc_named says whether s is called name, or is an instance of a
+ * template called name.
+ */
+static int
+svc_named(const struct service *s, const char *name)
+{
+	if (NULL != s->tmpl) {
+		return 0 == strcmp(s->tmpl->name, name);
+	}
+	return 0 == strcmp(s->name, name);
+}
+
+
+/*
+ * svc_resolve looks up the services each one comes after, where either
+ * is new, so services that come after a template come after instances
+ * added later too, and breaks any cycles among them.
+ */
+static void
+svc_resolve(void)
+{
+	struct service	*s, *o, **after;
+	size_t		 i, j, k;
+	int		 found;
+
+	for (i = 0; i < nservices; i++) {
+		s = services[i];
+		for (j = 0; j < s->nafter_names; j++) {
+			found = 0;
+			for (k = 0; k < nservices; k++) {
+				o = services[k];
+				if (k == i || (NULL != s->tmpl &&
+				    s->tmpl == o->tmpl) ||
+				    !svc_named(o, s->after_names[j])) {
+					continue;
+				}
+				found = 1;
+				if (s->resolved && o->resolved) {
+					continue;
+				}
+				after = reallocarray(s->after, s->nafter + 1,
+				    sizeof(*s->after));
+				if (NULL == after) {
+					err(EXIT_FAILURE, "out of memory");
+				}
+				s->after = after;
+				s->after[s->nafter++] = o;
+			}
+			if (!found && !s->resolved && NULL == s->tmpl) {
+				warnx("%s comes after unknown service %s",
+				    s->name, s->after_names[j]);
+			}
+		}
+	}
+
+	for (i = 0; i < nservices; i++) {
+		services[i]->resolved = 1;
+	}
+	for (i = 0; i < nservices; i++) {
+		services[i]->visiting = 0;
+	}
+	for (i = 0; i < nservices; i++) {
+		if (0 == services[i]->visiting) {
+			svc_cycle(services[i]);
+		}
+	}
+}
+
+
+/*
+ * svc_start_all queues every service to start, bar instances that
+ * aren't wanted yet.
+ */
+static void
+svc_start_all(void)
+{
+	long	 ncpu;
+	size_t	 i;
+
+	if (0 == restart_limit) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		restart_limit = 2 * (size_t)(ncpu > 0 ? ncpu : 1);
+	}
+
+	svc_resolve();
+	started = 1;
+	for (i = 0; i < nservices; i++) {
+		svc_queue(services[i]);
+	}
+}
+
+
+/*
+ * svc_stop_all shuts persist down: every running service is stopped,
+ * each once everything that comes after it has, so as much as possible
+ * stops at once, and the loop ends when they're all gone.
+ */
+static void
+svc_stop_all(void)
+{
+	struct service	*s;
+	size_t		 i, j;
+
+	if (stopping) {
+		return;
+	}
+	stopping = 1;
+	if (sim) {
+		sim_log("shutting down");
+	} else {
+		syslog(LOG_NOTICE, "shutting down");
+	}
+
+	for (i = 0; i < nservices; i++) {
+		if (0 == (s = services[i])->pid) {
+			continue;
+		}
+		nstopping++;
+		for (j = 0; j < s->nafter; j++) {
+			s->after[j]->holders++;
+		}
+	}
+	if (0 == nstopping) {
+		loop_done = 1;
+		return;
+	}
+
+	for (i = 0; i < nservices; i++) {
+		if (0 == services[i]->holders) {
+			svc_stop(services[i]);
+		}
+	}
+}
+
+
+/*
+ * sig_read shuts persist down when it's asked to stop.
+ */
+static void
+sig_read(struct handler *h)
+{
+	struct signalfd_siginfo	 si;
+
+	if ((ssize_t)sizeof(si) == read(h->fd, &si, sizeof(si))) {
+		svc_stop_all();
+	}
+}
+
+
+/*
+ * sig_init has SIGTERM and SIGINT arrive on the event loop. They're
+ * blocked before the pool starts, so no worker takes one, and
+ * unblocked again in everything the watcher runs.
+ */
+static void
+sig_init(void)
+{
+	static struct loopstat	 sig_stat = {.name = "signals"};
+	static struct handler	 sig = {-1, "signals", sig_read, &sig_stat, 0};
+	sigset_t		 set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+	if (-1 == (sig.fd = signalfd(-1, &set, SFD_NONBLOCK|SFD_CLOEXEC))) {
+		err(EXIT_FAILURE, "couldn't watch signals");
+	}
+	add_handler(&sig);
+}
+
+
+/*
+ * svc_bypid finds the service pid belongs to: the one it's the main
+ * process of, or failing that, the one whose cgroup, or one below it,
+ * it's in. /proc/pid/cgroup gives the path from the cgroup2 mount.
+ */
+static struct service *
+svc_bypid(pid_t pid)
+{
+	char		 buf[PATH_MAX + 64], *cg;
+	const char	*path;
+	ssize_t		 n;
+	size_t		 i, len;
+	int		 fd;
+
+	for (i = 0; i < nservices; i++) {
+		if (pid == services[i]->pid) {
+			return services[i];
+		}
+	}
+	if (NULL == cg_root || -1 == (fd = open(arena_cat("/proc/",
+	    utoa((unsigned long)pid), "/cgroup", NULL), O_RDONLY|O_CLOEXEC))) {
+		return NULL;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		return NULL;
+	}
+	buf[n] = 0;
+
+	for (cg = buf; 0 != strncmp(cg, "0::", 3); cg++) {
+		if (NULL == (cg = strchr(cg, '\n'))) {
+			return NULL;
+		}
+	}
+	cg += 3;
+	cg[strcspn(cg, "\n")] = 0;
+
+	for (i = 0; i < nservices; i++) {
+		if (NULL == services[i]->cg_path) {
+			continue;
+		}
+		path = services[i]->cg_path + cg_mntlen;
+		len = strlen(path);
+		if (0 == strncmp(cg, path, len) &&
+		    (0 == cg[len] || '/' == cg[len])) {
+			return services[i];
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * notify_read takes the queue depths services report. Anything else
+ * they say, or anything from outside them, is ignored.
+ */
+static void
+notify_read(struct handler *h)
+{
+	union {
+		struct cmsghdr	 hdr;
+		char		 buf[CMSG_SPACE(sizeof(struct ucred))];
+	}			 cm;
+	struct msghdr		 msg;
+	struct iovec		 iov;
+	struct cmsghdr		*cmsg;
+	struct ucred		 cred;
+	struct service		*s;
+	char			 buf[4096], *line, *last;
+	ssize_t			 n;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = buf;
+		iov.iov_len = sizeof(buf) - 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &cm;
+		msg.msg_controllen = sizeof(cm);
+		if (-1 == (n = recvmsg(h->fd, &msg, MSG_CMSG_CLOEXEC))) {
+			return;
+		}
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (NULL == cmsg || SOL_SOCKET != cmsg->cmsg_level ||
+		    SCM_CREDENTIALS != cmsg->cmsg_type) {
+			continue;
+		}
+		memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+		if (NULL == (s = svc_bypid(cred.pid))) {
+			continue;
+		}
+		buf[n] = 0;
+		for (line = strtok_r(buf, "\n", &last); NULL != line;
+		    line = strtok_r(NULL, "\n", &last)) {
+			if (0 == strncmp(line, "QUEUE=", 6)) {
+				s->queue = strtoull(line + 6, NULL, 10);
+			}
+		}
+	}
+}
+
+
+/*
+ * notify_init opens the notify socket, if any template is scaled on
+ * its queue, and hands it to services in their environment.
+ */
+static void
+notify_init(void)
+{
+	static struct loopstat	 notify_stat = {.name = "notify"};
+	static struct handler	 notify = {-1, "notify", notify_read,
+				    &notify_stat, 0};
+	struct sockaddr_un	 sun;
+	size_t			 i;
+	int			 on = 1;
+
+	for (i = 0; i < ntemplates && !templates[i]->by_queue; i++) {
+		continue;
+	}
+	if (i == ntemplates) {
+		return;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, NOTIFY_SOCKET, sizeof(sun.sun_path) - 1);
+
+	/*
+	 * The socket's mode is set before it's bound, so the path never
+	 * exists with a wider one; it's only opened up to NOTIFY_GID once
+	 * it belongs to that group.
+	 */
+	notify.fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	unlink(NOTIFY_SOCKET);
+	if (-1 == notify.fd || -1 == setsockopt(notify.fd, SOL_SOCKET,
+	    SO_PASSCRED, &on, sizeof(on)) ||
+	    -1 == fchmod(notify.fd, 0600) ||
+	    -1 == bind(notify.fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+	    (-1 != NOTIFY_GID &&
+	    (-1 == chown(NOTIFY_SOCKET, (uid_t)-1, (gid_t)NOTIFY_GID) ||
+	    -1 == chmod(NOTIFY_SOCKET, 0660)))) {
+		warn("couldn't open notify socket %s", NOTIFY_SOCKET);
+		if (-1 != notify.fd) {
+			close(notify.fd);
+			notify.fd = -1;
+		}
+		return;
+	}
+
+	setenv(NOTIFY_ENV, NOTIFY_SOCKET, 1);
+	add_handler(&notify);
+}
+
+
+/*
+ * svc_cpu reads the CPU time s has used: its whole cgroup's, or without
+ * one, its main process's. It returns -1 if it can't.
+ */
+static int
+svc_cpu(struct service *s, uint64_t *ns)
+{
+	struct timespec	 ts;
+	clockid_t	 clk;
+
+	if (0 == cg_cpu(s, ns)) {
+		return 0;
+	}
+	if (0 != clock_getcpuclockid(s->pid, &clk) ||
+	    0 != clock_gettime(clk, &ts)) {
+		return -1;
+	}
+	*ns = (uint64_t)ts.tv_sec * SEC + (uint64_t)ts.tv_nsec;
+	return 0;
+}
+
+
+/*
+ * svc_sample is the periodic sample of a service's CPU use, over the
+ * time since the last sample: jitter, or a busy loop, can stretch or
+ * shrink it from SVC_SAMPLE_INTERVAL. A service that's restarted since
+ * the last sample is measured from scratch. Under simulation, CPU use
+ * is scripted.
+ */
+static void
+svc_sample(void *arg)
+{
+	struct service	*s = arg;
+	uint64_t	 cpu, now;
+
+	if (sim) {
+		return;
+	}
+	if (0 == s->pid || -1 == svc_cpu(s, &cpu)) {
+		s->cpu = 0;
+		s->sample_pid = 0;
+		return;
+	}
+
+	now = now_ns();
+	s->cpu = s->sample_pid == s->pid && cpu >= s->sample_cpu &&
+	    now > s->sample_at ?
+	    (double)(cpu - s->sample_cpu) / (double)(now - s->sample_at) : 0;
+	s->sample_pid = s->pid;
+	s->sample_cpu = cpu;
+	s->sample_at = now;
+}
+
+
+/*
+ * loop_init creates the event loop, for handlers to be added to.
+ */
+static void
+loop_init(void)
+{
+	if (-1 == (epfd = epoll_create1(EPOLL_CLOEXEC))) {
+		err(EXIT_FAILURE, "couldn't start event loop");
+	}
+}
+
+
+/*
+ * loop_run runs the event loop until loop_done is set, once everything
+ * has been stopped. Each iteration's busy time is recorded as loop
+ * latency, since it's how long any event arriving meanwhile waits.
+ *
+ * Under simulation there's nothing to wait for: the virtual clock jumps
+ * straight to the next timer, and the loop also returns if there are no
+ * timers left.
+ */
+static void
+loop_run(void)
+{
+	static struct loopstat	 timer_stat = {.name = "timers"};
+	static struct loopstat	 flush_stat = {.name = "flush"};
+	struct epoll_event	 evs[16];
+	struct handler		*h;
+	struct loopstat		*st;
+	struct sample		 t;
+	int			 i, n;
+
+	loop_link(&timer_stat);
+	loop_link(&flush_stat);
+	while (!loop_done) {
+		if (sim) {
+			if (0 == ntimers) {
+				break;
+			}
+			if (timers[0].when > sim_clock) {
+				sim_clock = timers[0].when;
+			}
+			n = 0;
+		} else {
+			n = epoll_wait(epfd, evs, 16, timer_timeout());
+		}
+		loop_woke = now_ns();
+		for (i = 0; i < n; i++) {
+			/* h may be gone once it's run, but its stat isn't. */
+			h = evs[i].data.ptr;
+			st = h->stat;
+			sample_begin(&t);
+			h->fn(h);
+			loop_account(st, &t);
+		}
+
+		sample_begin(&t);
+		timer_run();
+		loop_account(&timer_stat, &t);
+		sample_begin(&t);
+		pool_flush();
+		loop_account(&flush_stat, &t);
+
+		op_done(OP_LOOP, loop_woke, NULL);
+		arena_reset();
+	}
+}
+
+
+/*
+ * check_run checks to see whether the parent process is running. before
+ * forking, the pid (or ppid) is stored in a static var. by stat(2)'ing
+ * /proc/pid, we can tell if the parent is running or not.
+ *
+ * if it's not running, we spawn a new parent process, which leaves this
+ * watcher, and the services it supervises, as they are.
+ *
+ * N.B. this will fail if the path named by exe isn't present, so this
+ * should be called right after check_bin for maximum success.
+ */
+static void
+check_run(void)
+{
+	posix_spawnattr_t	 attr;
+	struct stat		 st;
+	sigset_t		 none;
+	char			*nargv[2] = {BIN_NAME, NULL};
+	uint64_t		 ns, found;
+	pid_t			 child;
+	int			 rv;
+
+	if (sim) {
+		rv = sim_orphaned ? -1 : 0;
+	} else {
+		/* A parent check_run started is reaped here. */
+		waitpid(pid, NULL, WNOHANG);
+		rv = stat(arena_cat("/proc/", utoa((unsigned long)pid), NULL),
+		    &st);
+	}
+	ns = op_done(OP_DETECT, probe_start, NULL);
+	if (0 == rv) {
+		/* Process is still running, so there's nothing to do. */
+		return;
+	}
+	PROBE3(exit, 0, pid, ns);
+
+	if (sim) {
+		sim_log("parent is gone; restarting it");
+		sim_orphaned = 0;
+		return;
+	}
+
+	/*
+	 * Process isn't running, so start a new one, and go on supervising
+	 * everything as before. posix_spawn returns once it's exec'd, which
+	 * is how long the restart took.
+	 */
+	found = now_ns();
+	sigemptyset(&none);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &none);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK|
+	    POSIX_SPAWN_SETSID);
+	setenv(WATCHER_ENV, utoa((unsigned long)getpid()), 1);
+	rv = posix_spawn(&child, exe, NULL, &attr, nargv, environ);
+	unsetenv(WATCHER_ENV);
+	posix_spawnattr_destroy(&attr);
+	if (0 != rv) {
+		syslog(LOG_ERR, "couldn't restart %s: %s", exe, strerror(rv));
+		return;
+	}
+
+	pid = child;
+	ns = op_done(OP_SPAWN, found, NULL);
+	PROBE3(spawn, 0, pid, ns);
+}
+
+
+/* 6 chars for "Name:\t", 7 chars for "persist", 1 char for "\n". */
+static const off_t	name_offs = 14;
+
+
+/*
+ * reset_comm is an attempt at rewriting the commandline. I'm not sure it works.
+ *
+ * ps(1) appears to use /proc/pid/cmdline (which is populated with argv) to
+ * display processes. You can see this when running persist; one shows up as
+ * "persist" and the other shows up as "bash" (e.g. BIN_NAME and WATCHER_NAME);
+ * the nargv construct used in main and check_run appears to be working
+ * correctly.
+ *
+ * however, pgrep(1) appears to use /proc/pid/status, which means pgrep will
+ * show both processes as "persist" (and therefore, so will persist). We
+ * try to rewrite this file, but it will likely fail. The kernel doesn't like
+ * processes changing this data.
+ */
+static void
+reset_comm(void)
+{
+	char		 buf[4096];
+	struct stat	 st;
+	off_t		 len, offs;
+	FILE		*comm = NULL;
+	char		*p = NULL;
+
+	asprintf(&p, "/proc/%u/comm", pid);
+	if (NULL != (comm = fopen(p, "w"))) {
+		fwrite(WATCHER_NAME, strlen(WATCHER_NAME), 1, comm);
+		fclose(comm);
+		comm = NULL;
+	} else {
+		warn("failed to rewrite commandline");
+	}
+
+	free(p);
+	p = NULL;
+
+	asprintf(&p, "/proc/%u/status", getpid());
+	if (-1 == stat(p, &st)) {
+		warn("failed to rewrite status");
+		goto fin;
+	}
+
+	memset(buf, 0, 4096);
+	len = st.st_size;
+	strcpy(buf, "Name:\t");
+	offs += 6;
+
+	strcpy(buf+offs, WATCHER_NAME);
+	offs += strlen(WATCHER_NAME);
+
+	buf[offs++] = 0xa;
+
+	if (NULL == (comm = fopen(p, "r"))) {
+		warn("failed to read status");
+		goto fin;
+	}
+
+	fseek(comm, name_offs, SEEK_SET);
+	if (-1 == fread(buf+offs, sizeof(char), len-name_offs, comm)) {
+		warn("failed to read status");
+		goto fin;
+	}
+	fclose(comm);
+	comm = NULL;
+
+	if (NULL == (comm = fopen(p, "w"))) {
+		warn("failed to write status");
+		goto fin;
+	}
+
+	if (-1 == fwrite(buf, sizeof(char), len-name_diff, comm)) {
+		warn("failed to write status");
+		goto fin;
+	}
+
+	fclose(comm);
+	comm = NULL;
+	printf("%s\n", buf);
+fin:
+	free(p);
+
+	if (NULL != comm) {
+		fclose(comm);
+	}
+}
+
+
+/*
+ * check_parent is the periodic timer for check_run, which runs once the
+ * exe has been checked. Once persist is shutting down, the parent is
+ * left gone.
+ */
+static void
+check_parent(void *arg)
+{
+	(void)arg;
+
+	if (stopping) {
+		return;
+	}
+	probe_start = now_ns();
+	if (sim) {
+		/* There's no exe to check first. */
+		check_run();
+	} else {
+		artifacts[0].then = check_run;
+		artifact_submit(&artifacts[0], JOB_PROBE);
+	}
+}
+
+
+/*
+ * periodic_start_all starts the supervisor's own periodic work, each
+ * service's CPU sampling, and autoscaling.
+ */
+static void
+periodic_start_all(void)
+{
+	static struct periodic	 check, merge;
+	size_t			 i;
+
+	periodic_start(&check, "check", CHECK_INTERVAL * SEC, check_parent,
+	    NULL);
+	periodic_start(&merge, "merge", HIST_MERGE * SEC, hist_tick, NULL);
+	for (i = 0; i < nservices; i++) {
+		periodic_start(&services[i]->sample, services[i]->name,
+		    SVC_SAMPLE_INTERVAL * SEC, svc_sample, services[i]);
+	}
+	for (i = 0; i < ntemplates; i++) {
+		if (templates[i]->min < templates[i]->max) {
+			periodic_start(&templates[i]->autoscale,
+			    templates[i]->name, AUTOSCALE_INTERVAL * SEC,
+			    tmpl_autoscale, templates[i]);
+		}
+	}
+}
+
+
+/*
+ * tmpl_scale changes how many instances of t run: new ones are queued
+ * to start all at once, and ones no longer wanted are stopped as at
+ * shutdown, and kept for later. Nothing changes once persist is
+ * shutting down, since that's counted what everything waits on.
+ */
+static void
+tmpl_scale(struct template *t, size_t n)
+{
+	struct service	*s;
+	size_t		 i, had = t->ninst;
+
+	if (stopping) {
+		return;
+	}
+
+	t->want = n;
+	while (t->ninst < n) {
+		s = tmpl_grow(t);
+		if (NULL != cg_root && -1 != cg_ifd) {
+			cg_add(s);
+		}
+		periodic_start(&s->sample, s->name, SVC_SAMPLE_INTERVAL * SEC,
+		    svc_sample, s);
+	}
+	/* New instances' dependencies are worked out in one go. */
+	if (t->ninst > had) {
+		svc_resolve();
+	}
+
+	for (i = 0; i < t->ninst; i++) {
+		s = t->inst[i];
+		if (i < n && s->retired) {
+			s->retired = 0;
+			if (started && !stopping) {
+				svc_queue(s);
+			}
+		} else if (i >= n && !s->retired) {
+			s->retired = 1;
+			s->queue = 0;
+			svc_stop(s);
+		}
+	}
+	if (sim) {
+		sim_log("%s scaled to %zu", t->name, n);
+	} else {
+		syslog(LOG_NOTICE, "%s scaled to %zu", t->name, n);
+	}
+}
+
+
+/*
+ * tmpl_autoscale is the periodic look at an autoscaled template: its
+ * load is summed over the instances that are wanted, and it's scaled,
+ * within its bounds, to how many it takes to carry that at target
+ * each.
+ */
+static void
+tmpl_autoscale(void *arg)
+{
+	struct template	*t = arg;
+	struct service	*s;
+	double		 need;
+	size_t		 i, n = t->want;
+
+	t->load = 0;
+	for (i = 0; i < t->ninst; i++) {
+		if (!(s = t->inst[i])->retired) {
+			t->load += t->by_queue ? (double)s->queue :
+			    s->cpu * 100;
+		}
+	}
+	if (stopping) {
+		return;
+	}
+
+	need = t->load / t->target;
+	if (need > (double)n * (100 + AUTOSCALE_BAND) / 100) {
+		t->low = 0;
+		if (0 == pressure_until) {
+			n = (size_t)need;
+			n += (double)n < need;
+		}
+	} else if (n > 0 &&
+	    need < (double)(n - 1) * (100 - AUTOSCALE_BAND) / 100) {
+		if (++t->low >= AUTOSCALE_HOLD) {
+			t->low = 0;
+			n--;
+		}
+	} else {
+		t->low = 0;
+	}
+
+	n = n < t->min ? t->min : n > t->max ? t->max : n;
+	if (n != t->want) {
+		tmpl_scale(t, n);
+	}
+}
+
+
+/*
+ * watch loads the manifest and checks every artifact once, starts the
+ * services, then runs the event loop: artifacts are checked on the job
+ * pool as the monitor reports changes to them, services are restarted
+ * as they exit, and check_run runs every CHECK_INTERVAL.
+ */
+static void
+watch(void)
+{
+	static struct loopstat	 mon_stat = {.name = "monitor"};
+	static struct loopstat	 pool_stat = {.name = "pool"};
+	static struct loopstat	 ctl_stat = {.name = "control"};
+	static struct handler	 mon = {-1, "monitor", mon_read, &mon_stat, 0};
+	static struct handler	 pool = {-1, "pool", pool_reap, &pool_stat, 0};
+	static struct handler	 ctl = {-1, "control", ctl_accept, &ctl_stat,
+				    0};
+	size_t			 i;
+
+	loop_init();
+	sig_init();
+	load_manifest();
+	cache_open();
+	pool_init(POOL_THREADS);
+	check_bin();
+	mon_init();
+
+	mon.fd = mon_fd;
+	add_handler(&mon);
+	pool.fd = pool_efd;
+	add_handler(&pool);
+	if (0 == ctl_init()) {
+		ctl.fd = ctl_fd;
+		add_handler(&ctl);
+	}
+	psi_init();
+	cg_init();
+	notify_init();
+	svc_start_all();
+	periodic_start_all();
+	for (i = 0; i < nartifacts; i++) {
+		periodic_start(&artifacts[i].scrub, artifacts[i].path,
+		    VERIFY_INTERVAL * SEC, artifact_scrub, &artifacts[i]);
+	}
+	loop_run();
+	exit(EXIT_SUCCESS);
+}
+
+
+static struct periodic	 spam_period;
+
+
+/*
+ * spam_tick writes a syslog message. For maxmimum fun, it uses LOG_EMERG
+ * to spam on every console.
+ */
+static void
+spam_tick(void *arg)
+{
+	(void)arg;
+
+	if (sim) {
+		sim_log("hey! you!");
+	} else {
+		syslog(LOG_EMERG, "hey! you!");
+	}
+}
+
+
+/*
+ * spam is a non-terminating loop that writes syslog messages every hour.
+ */
+static void
+spam(void)
+{
+	spam_tick(NULL);
+	periodic_start(&spam_period, "spam", SPAM_INTERVAL * SEC, spam_tick,
+	    NULL);
+	while (1) {
+		poll(NULL, 0, timer_timeout());
+		timer_run();
+	}
+}
+
+
+#ifndef PERSIST_SMALL
+/*
+ * A sim_event is a line of a simulation script: at when, what happens
+ * to svc, or to persist's parent if svc is NULL, or which pressure
+ * trigger fires. n is how many instances of tmpl are wanted, or the
+ * load svc reports.
+ */
+struct sim_event {
+	uint64_t	 when;
+	char		 what;
+	struct service	*svc;
+	struct psi	*psi;
+	struct template	*tmpl;
+	size_t		 n;
+};
+
+
+/*
+ * sim_fire makes a scripted event happen.
+ */
+static void
+sim_fire(void *arg)
+{
+	struct sim_event	*ev = arg;
+
+	switch (ev->what) {
+	case 'x':
+		if (0 == ev->svc->pid) {
+			sim_log("%s isn't running", ev->svc->name);
+			break;
+		}
+		sim_log("%s exited", ev->svc->name);
+		svc_died(ev->svc);
+		break;
+	case 'f':
+		ev->svc->fail++;
+		break;
+	case 'h':
+		ev->svc->hang = 1;
+		break;
+	case 's':
+		svc_stop_all();
+		break;
+	case 'p':
+		sim_log("parent exited");
+		sim_orphaned = 1;
+		break;
+	case 'P':
+		psi_fire(ev->psi);
+		break;
+	case 'S':
+		tmpl_scale(ev->tmpl, ev->n);
+		break;
+	case 'c':
+		ev->svc->cpu = (double)ev->n / 100;
+		break;
+	case 'q':
+		ev->svc->queue = ev->n;
+		break;
+	case 'a':
+		sim_log("steady");
+#ifdef ALLOC_CHECK
+		alloc_start();
+#endif
+		break;
+	case 'e':
+		loop_done = 1;
+		break;
+	}
+}
+
+
+/*
+ * simulate runs the supervisor's timers on a virtual clock, driven by
+ * the script at path, and prints what it does and when. Script lines
+ * are:
+ *	service NAME [OPT ...]	NAME is a service, started at 0, with
+ *				manifest options OPT
+ *	limit N			at most N services start at once, rather
+ *				than twice the number of CPUs
+ *	AT scale NAME N		N instances of NAME are wanted
+ *	AT cpu NAME N		NAME starts using N percent of a CPU
+ *	AT queue NAME N		NAME reports N items queued
+ *	AT exit NAME		NAME exits AT seconds in
+ *	AT fail NAME		NAME's next start fails
+ *	AT hang NAME		NAME ignores its stop signal
+ *	AT parent-exit		persist's parent exits
+ *	AT pressure RESOURCE	memory, cpu or io pressure is reported
+ *	AT shutdown		persist is asked to stop
+ *	AT steady		from here on, nothing should be allocated
+ *	AT end			the simulation stops
+ * Without an end, it stops at the last event, or if there's a shutdown,
+ * once that's done. Nothing is spawned or touched, and hours of
+ * supervision run in milliseconds. Built with ALLOC_CHECK, it fails if
+ * anything was allocated or freed after a steady. persist/sim has
+ * scenarios with their expected output, and run.sh to check them.
+ */
+static int
+simulate(const char *path)
+{
+	struct sim_event	*ev;
+	struct conn		 c;
+	FILE			*f;
+	char			*line = NULL, *tok, *what, *name;
+	char			*argv[2] = {NULL, NULL}, *opts[SVC_MAX_OPTS];
+	const char		*bad;
+	size_t			 linecap = 0, i;
+	uint64_t		 last = 0;
+	unsigned long		 allocs = 0;
+	int			 shut = 0, nopts;
+
+	if (NULL == (f = fopen(path, "r"))) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+
+	sim = 1;
+	while (-1 != getline(&line, &linecap, f)) {
+		if (NULL == (tok = strtok(line, " \t\n")) || '#' == tok[0]) {
+			continue;
+		}
+		what = strtok(NULL, " \t\n");
+		if (0 == strcmp(tok, "service")) {
+			if (NULL == what) {
+				errx(EXIT_FAILURE, "%s: service needs a name",
+				    path);
+			}
+			argv[0] = what;
+			nopts = 0;
+			while (nopts < SVC_MAX_OPTS &&
+			    NULL != (tok = strtok(NULL, " \t\n"))) {
+				opts[nopts++] = tok;
+			}
+			if (NULL != (bad = svc_define(what, argv, opts,
+			    nopts))) {
+				errx(EXIT_FAILURE, "%s: unknown option %s",
+				    path, bad);
+			}
+			continue;
+		}
+		if (0 == strcmp(tok, "limit")) {
+			if (NULL == what ||
+			    0 == (restart_limit = strtoul(what, NULL, 10))) {
+				errx(EXIT_FAILURE, "%s: limit needs a number",
+				    path);
+			}
+			continue;
+		}
+
+		if (NULL == what || NULL == (ev = calloc(1, sizeof(*ev)))) {
+			errx(EXIT_FAILURE, "%s: bad line", path);
+		}
+		ev->when = (uint64_t)(atof(tok) * SEC);
+		if (0 == strcmp(what, "exit")) {
+			ev->what = 'x';
+		} else if (0 == strcmp(what, "fail")) {
+			ev->what = 'f';
+		} else if (0 == strcmp(what, "hang")) {
+			ev->what = 'h';
+		} else if (0 == strcmp(what, "shutdown")) {
+			ev->what = 's';
+			shut = 1;
+		} else if (0 == strcmp(what, "parent-exit")) {
+			ev->what = 'p';
+		} else if (0 == strcmp(what, "pressure")) {
+			ev->what = 'P';
+		} else if (0 == strcmp(what, "scale")) {
+			ev->what = 'S';
+		} else if (0 == strcmp(what, "cpu")) {
+			ev->what = 'c';
+		} else if (0 == strcmp(what, "queue")) {
+			ev->what = 'q';
+		} else if (0 == strcmp(what, "steady")) {
+			ev->what = 'a';
+		} else if (0 == strcmp(what, "end")) {
+			ev->what = 'e';
+		} else {
+			errx(EXIT_FAILURE, "%s: unknown event %s", path, what);
+		}
+
+		if ('x' == ev->what || 'f' == ev->what || 'h' == ev->what ||
+		    'c' == ev->what || 'q' == ev->what) {
+			name = strtok(NULL, " \t\n");
+			for (i = 0; NULL != name && i < nservices; i++) {
+				if (0 == strcmp(services[i]->name, name)) {
+					ev->svc = services[i];
+				}
+			}
+			if (NULL == ev->svc) {
+				errx(EXIT_FAILURE, "%s: no service %s", path,
+				    NULL == name ? "named" : name);
+			}
+		}
+		if ('P' == ev->what) {
+			name = strtok(NULL, " \t\n");
+			for (i = 0; NULL != name &&
+			    i < sizeof(psis) / sizeof(psis[0]); i++) {
+				if (0 == strcmp(psis[i].resource, name)) {
+					ev->psi = &psis[i];
+				}
+			}
+			if (NULL == ev->psi) {
+				errx(EXIT_FAILURE, "%s: no pressure %s", path,
+				    NULL == name ? "named" : name);
+			}
+		}
+		if ('S' == ev->what) {
+			name = strtok(NULL, " \t\n");
+			tok = strtok(NULL, " \t\n");
+			if (NULL == name || NULL == tok ||
+			    NULL == (ev->tmpl = tmpl_find(name))) {
+				errx(EXIT_FAILURE, "%s: no template %s", path,
+				    NULL == name ? "named" : name);
+			}
+			ev->n = strtoul(tok, NULL, 10);
+		}
+		if ('c' == ev->what || 'q' == ev->what) {
+			if (NULL == (tok = strtok(NULL, " \t\n"))) {
+				errx(EXIT_FAILURE, "%s: %s needs a number",
+				    path, what);
+			}
+			ev->n = strtoul(tok, NULL, 10);
+		}
+		if (ev->when > last) {
+			last = ev->when;
+		}
+		timer_add(ev->when, sim_fire, ev);
+	}
+	free(line);
+	fclose(f);
+
+	if (!shut) {
+		if (NULL == (ev = calloc(1, sizeof(*ev)))) {
+			err(EXIT_FAILURE, "out of memory");
+		}
+		ev->when = last;
+		ev->what = 'e';
+		timer_add(last, sim_fire, ev);
+	}
+
+	loop_init();
+	svc_start_all();
+	periodic_start_all();
+	spam_tick(NULL);
+	periodic_start(&spam_period, "spam", SPAM_INTERVAL * SEC, spam_tick,
+	    NULL);
+	loop_run();
+#ifdef ALLOC_CHECK
+	allocs = alloc_stop();
+#endif
+
+	sim_log("done");
+	if (allocs > 0) {
+		sim_log("%lu allocations in steady state", allocs);
+	}
+	memset(&c, 0, sizeof(c));
+	hist_merge();
+	ctl_status(&c);
+	fwrite(c.out, 1, c.outlen, stdout);
+	free(c.out);
+	return allocs > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
+
+#ifndef PERSIST_SMALL
+/*
+ * A scale_msg is what each of scale_bench's dummy services sends when
+ * it starts.
+ */
+struct scale_msg {
+	uint32_t	 idx;
+	int32_t		 pid;
+	uint64_t	 ns;
+};
+
+
+/*
+ * idle is a dummy service for scale_bench: it reports in on fd and
+ * waits to be killed.
+ */
+static void
+idle(uint32_t idx, int fd)
+{
+	struct scale_msg	 m = {idx, (int32_t)getpid(), now_ns()};
+
+	write(fd, &m, sizeof(m));
+	close(fd);
+	while (1) {
+		pause();
+	}
+}
+#endif
+
+
+/*
+ * proc_usage reads the CPU time, in ns, and RSS, in KiB, of process p.
+ */
+static void
+proc_usage(pid_t p, uint64_t *cpu, uint64_t *rss)
+{
+	struct timespec	 ts;
+	clockid_t	 clk;
+	char		 buf[128];
+	unsigned long	 size, resident;
+	ssize_t		 n;
+	int		 fd;
+
+	*cpu = *rss = 0;
+	if (0 == clock_getcpuclockid(p, &clk) &&
+	    0 == clock_gettime(clk, &ts)) {
+		*cpu = (uint64_t)ts.tv_sec * SEC + (uint64_t)ts.tv_nsec;
+	}
+
+	if (-1 == (fd = open(arena_cat("/proc/", utoa((unsigned long)p),
+	    "/statm", NULL), O_RDONLY|O_CLOEXEC))) {
+		return;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n > 0) {
+		buf[n] = 0;
+		if (2 == sscanf(buf, "%lu %lu", &size, &resident)) {
+			*rss = (uint64_t)resident *
+			    (uint64_t)sysconf(_SC_PAGESIZE) / 1024;
+		}
+	}
+}
+
+
+#ifndef PERSIST_SMALL
+/*
+ * scale_run supervises n dummy services in a child, kills one at
+ * random rate times a second for secs seconds, and prints a row of
+ * results. base is the RSS of a supervisor with no services, for the
+ * per-service cost; the row's own RSS is returned.
+ */
+static uint64_t
+scale_run(size_t n, double rate, double secs, uint64_t base)
+{
+	struct scale_msg	 m;
+	struct pollfd		 pfd;
+	struct hist		 lat;
+	char			*argv[5];
+	char			 exe[PATH_MAX];
+	pid_t			 sup, *pids;
+	uint64_t		*killed, cpu0, cpu1, rss, now, next, end;
+	uint64_t		 kills = 0;
+	size_t			 i, up = 0;
+	ssize_t			 len;
+	int			 fds[2], tries;
+
+	memset(&lat, 0, sizeof(lat));
+	pids = calloc(n + 1, sizeof(*pids));
+	killed = calloc(n + 1, sizeof(*killed));
+	if (NULL == pids || NULL == killed ||
+	    -1 == (len = readlink("/proc/self/exe", exe, sizeof(exe) - 1)) ||
+	    -1 == pipe(fds)) {
+		err(EXIT_FAILURE, "scalebench");
+	}
+	exe[len] = 0;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+	switch (sup = fork()) {
+	case -1:
+		err(EXIT_FAILURE, "scalebench");
+	case 0:
+		close(fds[0]);
+		raise_nofile();
+		loop_init();
+		argv[0] = exe;
+		argv[1] = "idle";
+		argv[3] = arena_cat(utoa((unsigned long)fds[1]), NULL);
+		argv[4] = NULL;
+		for (i = 0; i < n; i++) {
+			argv[2] = utoa(i);
+			svc_add(argv[2], argv);
+		}
+		arena_reset();
+		/* This measures supervision, not the start queue. */
+		restart_limit = SIZE_MAX;
+		svc_start_all();
+		loop_run();
+		_exit(EXIT_SUCCESS);
+	}
+	close(fds[1]);
+
+	/* Wait for everything to come up before taking measurements. */
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	while (up < n && poll(&pfd, 1, 60 * 1000) > 0 &&
+	    (ssize_t)sizeof(m) == read(fds[0], &m, sizeof(m))) {
+		if (m.idx < n && 0 == pids[m.idx]) {
+			up++;
+		}
+		pids[m.idx] = m.pid;
+	}
+	sleep(1);
+	proc_usage(sup, &cpu0, &rss);
+
+	now = now_ns();
+	end = now + (uint64_t)(secs * SEC);
+	next = now;
+	while ((now = now_ns()) < end) {
+		if (n > 0 && rate > 0 && now >= next) {
+			for (tries = 0; tries < 16; tries++) {
+				i = (size_t)random() % n;
+				if (0 != pids[i] && 0 == killed[i]) {
+					killed[i] = now_ns();
+					kill(pids[i], SIGKILL);
+					pids[i] = 0;
+					kills++;
+					break;
+				}
+			}
+			next += (uint64_t)(SEC / rate);
+		}
+
+		if (poll(&pfd, 1, n > 0 && rate > 0 ?
+		    (int)((next > now ? next - now : 0) / MSEC) :
+		    (int)((end - now) / MSEC)) > 0 &&
+		    (ssize_t)sizeof(m) == read(fds[0], &m, sizeof(m)) &&
+		    m.idx < n) {
+			pids[m.idx] = m.pid;
+			if (0 != killed[m.idx]) {
+				lat.buckets[hist_index(m.ns - killed[m.idx])]++;
+				lat.count++;
+				killed[m.idx] = 0;
+			}
+		}
+	}
+	proc_usage(sup, &cpu1, &rss);
+
+	kill(sup, SIGKILL);
+	waitpid(sup, NULL, 0);
+	for (i = 0; i < n; i++) {
+		if (0 != pids[i]) {
+			kill(pids[i], SIGKILL);
+		}
+	}
+
+	/* Anything started since reports in before the pipe closes. */
+	while (poll(&pfd, 1, 10 * 1000) > 0 &&
+	    (ssize_t)sizeof(m) == read(fds[0], &m, sizeof(m))) {
+		kill(m.pid, SIGKILL);
+	}
+	for (lat.max = 0, i = 0; i < HIST_BUCKETS; i++) {
+		if (lat.buckets[i]) {
+			lat.max = hist_value(i);
+		}
+	}
+
+	printf("%zu\t%llu\t%.2f\t%llu\t%.1f\t%.3f\t%.3f\t%.3f\n", n,
+	    (unsigned long long)rss, n > 0 && rss > base ?
+	    (double)(rss - base) / (double)n : 0.0,
+	    (unsigned long long)kills, kills ?
+	    (double)(cpu1 - cpu0) / (double)kills / 1e3 : 0.0,
+	    (double)hist_quantile(&lat, 0.5) / 1e6,
+	    (double)hist_quantile(&lat, 0.99) / 1e6,
+	    (double)hist_quantile(&lat, 0.999) / 1e6);
+	fflush(stdout);
+
+	close(fds[0]);
+	free(pids);
+	free(killed);
+	return rss;
+}
+
+
+/*
+ * scale_bench runs scale_run for no services, to set a baseline, and
+ * then for 10, 100 and so on up to max, printing tab-separated rows:
+ * services, supervisor RSS in KiB, KiB per service, kills, supervisor
+ * CPU in us per kill, and p50, p99 and p99.9 kill-to-restart latency in
+ * ms. A super-linear cost shows up as a column growing with services.
+ */
+static void
+scale_bench(size_t max, double rate, double secs)
+{
+	uint64_t	 base;
+	size_t		 n;
+
+	srandom((unsigned)getpid());
+	printf("services\trss_kib\tkib_per_svc\tkills\tcpu_us_per_kill\t"
+	    "p50_ms\tp99_ms\tp999_ms\n");
+	base = scale_run(0, 0, 1, 0);
+	for (n = 10; n < max; n *= 10) {
+		scale_run(n, rate, secs, base);
+	}
+	scale_run(max, rate, secs, base);
+}
+#endif
+
+
+/*
+ * bench times the primitives on persist's hot paths. Each is run for
+ * BENCH_REP_MS, BENCH_REPS times over, and the fastest rep reported:
+ * on a shared host, that's the one least disturbed by everything else.
+ * Against a baseline, a result more than BENCH_TOLERANCE worse fails.
+ * Built with ALLOC_CHECK, so does any benchmark that still calls the
+ * allocator once warmed up, in a row of its own. The small profile
+ * only measures its footprint, which is what it's built for.
+ */
+#define BENCH_REPS	5
+#define BENCH_REP_MS	50
+#ifndef BENCH_TOLERANCE
+#define BENCH_TOLERANCE	0.25
+#endif
+#define BENCH_MAX	64
 
-#ifndef MAX_PATH
-#define MAX_PATH	4096
+struct bench_base {
+	char		 name[64];
+	double		 value;
+};
+
+static struct bench_base	 bench_bases[BENCH_MAX];
+static size_t			 bench_nbases = 0;
+static int			 bench_failed = 0;
+#ifdef ALLOC_CHECK
+static unsigned long		 bench_allocs = 0;
 #endif
 
 
-static pid_t	 pid = 0;
-static char	*name = NULL;
-static char	 exe[PATH_MAX];
-static ssize_t	 exelen = 0;
-static off_t	 name_diff = 0;
+/*
+ * bench_load reads a baseline: bench's own output from an earlier run.
+ */
+static void
+bench_load(const char *path)
+{
+	FILE		*f;
+	char		 line[256];
+	struct bench_base	*b;
+
+	if (NULL == (f = fopen(path, "r"))) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+	while (bench_nbases < BENCH_MAX &&
+	    NULL != fgets(line, sizeof(line), f)) {
+		b = &bench_bases[bench_nbases];
+		if (2 == sscanf(line, "%63s %lf", b->name, &b->value)) {
+			bench_nbases++;
+		}
+	}
+	fclose(f);
+}
 
 
 /*
- * init prepopulates the original exe pathname.
- *
- * before we start forking around (keeping in mind the child process
- * will attempt to rename itself), we need to know where the original
- * program is. this probably should be done before the file is deleted,
- * otherwise the " (deleted)" part of the name needs to be removed,
- * which is doable but extra work.
- *
- * this exe name is kept around so we know where to write the restored
- * file to in the event the original is deleted. this works by using
- * the Linux procfs system: /proc/$$/exe is a special link; it can be
- * read like a normal file (even if the target is deleted), and if
- * readlink(2) is called on it, it returns the original path to the
- * program (with " (deleted)" appended if the original was unlinked).
+ * bench_report prints a result, and checks it against the baseline.
  */
 static void
-init(void)
+bench_report(const char *name, double value, const char *unit, int higher)
 {
-	char	*p = NULL;
+	double	 base = 0, limit = 0;
+	size_t	 i;
+	int	 bad;
 
-	memset(exe, 0, MAX_PATH+1);
-	asprintf(&p, "/proc/%u/exe", pid);
-	exelen = readlink(p, exe, MAX_PATH);
-	free(p);
+	for (i = 0; i < bench_nbases; i++) {
+		if (0 == strcmp(bench_bases[i].name, name)) {
+			base = bench_bases[i].value;
+		}
+	}
 
-	if (-1 == exelen) {
-		err(EXIT_FAILURE, "couldn't look up original file (%u, %s)", pid, p);
+	if (base > 0) {
+		limit = base * (higher ? 1 - BENCH_TOLERANCE :
+		    1 + BENCH_TOLERANCE);
+		bad = higher ? value < limit : value > limit;
+		bench_failed |= bad;
+		printf("%s\t%.1f\t%s\t%.1f\t%s\n", name, value, unit, limit,
+		    bad ? "FAIL" : "ok");
+	} else {
+		printf("%s\t%.1f\t%s\t-\t-\n", name, value, unit);
+	}
+#ifdef ALLOC_CHECK
+	if (bench_allocs > 0) {
+		printf("%s_allocs\t%lu\tcalls\t0\tFAIL\n", name,
+		    bench_allocs);
+		bench_failed = 1;
+		bench_allocs = 0;
 	}
+#endif
+	fflush(stdout);
+}
 
-	name_diff = (strlen(BIN_NAME) - strlen(WATCHER_NAME));
+
+#ifndef PERSIST_SMALL
+static int
+bench_cmp(const void *a, const void *b)
+{
+	double	 x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
 }
 
 
 /*
- * check_bin makes sure the original exe (as named by the exe value) is
- * present. if not, the current program (/proc/getpid()/exe) is copied
- * to the path named by exe using the sendfile(2) syscall.
+ * bench_ns returns the best time, in ns, of a call to fn.
  */
+static double
+bench_ns(void (*fn)(void *), void *arg)
+{
+	double		 reps[BENCH_REPS];
+	uint64_t	 start, elapsed, iters;
+	int		 r;
+
+	for (r = 0; r < BENCH_REPS; r++) {
+		iters = 0;
+		start = now_ns();
+		do {
+			fn(arg);
+			iters++;
+		} while ((elapsed = now_ns() - start) < BENCH_REP_MS * MSEC);
+		reps[r] = (double)elapsed / (double)iters;
+	}
+
+#ifdef ALLOC_CHECK
+	/* Warmed up by now, so another rep's worth shouldn't allocate. */
+	alloc_start();
+	start = now_ns();
+	do {
+		fn(arg);
+	} while (now_ns() - start < BENCH_REP_MS * MSEC);
+	bench_allocs = alloc_stop();
+#endif
+
+	qsort(reps, BENCH_REPS, sizeof(reps[0]), bench_cmp);
+	return reps[0];
+}
+
+
+/* The /proc lookups init and check_run make. */
 static void
-check_bin(void)
+bench_proc_exe(void *arg)
+{
+	char	 buf[PATH_MAX];
+
+	(void)arg;
+	readlink(arena_cat("/proc/", utoa((unsigned long)pid), "/exe", NULL),
+	    buf, sizeof(buf));
+	arena_reset();
+}
+
+
+static void
+bench_proc_stat(void *arg)
 {
 	struct stat	 st;
-	int		 failed = 0;
-	char		*p = NULL;
-	off_t		 origlen;
-	int		 src = 0, dst = 0;
 
-	if (0 == stat(exe, &st)) {
-		/*
-		 * The original is in place, and we don't need to do anything.
-		 */
-		goto fin;
-	}
+	(void)arg;
+	stat(arena_cat("/proc/", utoa((unsigned long)pid), NULL), &st);
+	arena_reset();
+}
 
-	asprintf(&p, "/proc/%u/exe", getpid());
 
-	/*
-	 * Now, figure out how big the exe actually is.
-	 */
-	if (-1 == stat(p, &st)) {
-		failed = 1;
-		goto fin;
+static void
+bench_restore(void *arg)
+{
+	struct artifact	*a = arg;
+
+	if (-1 == restore(a)) {
+		err(EXIT_FAILURE, "%s", a->path);
 	}
+	arena_reset();
+}
 
-	origlen = st.st_size;
 
-	/*
-	 * Open file descriptors for the source and destination files;
-         * these are used by sendfile(2).
-	 */
-	if (-1 == (dst = open(exe, O_CREAT|O_WRONLY, 0755))) {
-		failed = 1;
-		goto fin;
-	}
+struct bench_buf {
+	unsigned char	*p;
+	size_t		 size;
+};
 
-	if (-1 == (src = open(p, O_RDONLY))) {
-		failed = 1;
-		goto fin;
-	}
 
-	if (-1 == sendfile(dst, src, 0, (size_t)origlen)) {
-		failed = 1;
-		goto fin;
-	}
+static void
+bench_hash(void *arg)
+{
+	struct bench_buf	*b = arg;
+	unsigned char		 digest[DIGEST_LEN];
 
-fin:
-	free(p);
+	tree_digest(b->p, -1, b->size, 0, 1, 1, digest);
+	arena_reset();
+}
 
-	if (dst > 0) {
-		close(dst);
-	}
 
-	if (src > 0) {
-		close(src);
-	}
+static void
+bench_trace_record(void *arg)
+{
+	(void)arg;
+	trace_span("bench", 1, 2, "/usr/bin/persist");
+}
 
-	if (failed) {
-		err(EXIT_FAILURE, "failed to restore");
-	}
+
+static void
+bench_trace_encode(void *arg)
+{
+	static const struct span	 sp = {0, "restore", "/usr/bin/persist",
+					    1000000, 2000000};
+	struct conn			*c = arg;
+
+	c->outlen = 0;
+	out_span(c, &sp, 1, 0);
 }
 
 
-/*
- * check_run checks to see whether the parent process is running. before
- * forking, the pid (or ppid) is stored in a static var. by stat(2)'ing
- * /proc/pid, we can tell if the parent is running or not.
- *
- * if it's not running, we execv into a new parent process.
- *
- * N.B. this will fail if the path named by exe isn't present, so this
- * should be called right after check_bin for maximum success.
- */
 static void
-check_run(void)
+bench_handler(struct handler *h)
 {
-	struct stat	 st;
-	char		*nargv[2] = {BIN_NAME, NULL};
-	char		*p = NULL;
+	uint64_t	 n;
 
-	asprintf(&p, "/proc/%u", pid);
-	if (0 == stat(p, &st)) {
-		/* Process is still running, so there's nothing to do. */
-		free(p);
-		return;
+	read(h->fd, &n, sizeof(n));
+}
+
+
+static void
+bench_dispatch(void *arg)
+{
+	struct handler		*h = arg;
+	struct handler		*ready;
+	struct epoll_event	 ev;
+	uint64_t		 one = 1;
+
+	write(h->fd, &one, sizeof(one));
+	if (1 == epoll_wait(epfd, &ev, 1, 0)) {
+		ready = ev.data.ptr;
+		ready->fn(ready);
 	}
+}
 
-	/* Process isn't running, so restart it. */
-	free(p);
-	execv(exe, nargv);
+
+static void
+bench_noop(void *arg)
+{
+	(void)arg;
 }
 
 
-/* 6 chars for "Name:\t", 7 chars for "persist", 1 char for "\n". */
-static const off_t	name_offs = 14;
+static void
+bench_job(struct job *j)
+{
+	(void)j;
+}
+
+
+/* A job's round trip through the pool, from off it. */
+static void
+bench_pool(void *arg)
+{
+	struct job	*j = arg;
+	atomic_long	 n;
+
+	atomic_init(&n, 1);
+	j->finished = &n;
+	pool_submit(j);
+	pool_help(&n);
+}
+
+
+static void
+bench_status(void *arg)
+{
+	struct conn	*c = arg;
+
+	c->outlen = 0;
+	ctl_status(c);
+}
+
+
+static void
+bench_timer(void *arg)
+{
+	(void)arg;
+	timer_add(now_ns(), bench_noop, NULL);
+	timer_run();
+}
 
 
 /*
- * reset_comm is an attempt at rewriting the commandline. I'm not sure it works.
- *
- * ps(1) appears to use /proc/pid/cmdline (which is populated with argv) to
- * display processes. You can see this when running persist; one shows up as
- * "persist" and the other shows up as "bash" (e.g. BIN_NAME and WATCHER_NAME);
- * the nargv construct used in main and check_run appears to be working
- * correctly.
- *
- * however, pgrep(1) appears to use /proc/pid/status, which means pgrep will
- * show both processes as "persist" (and therefore, so will persist). We
- * try to rewrite this file, but it will likely fail. The kernel doesn't like
- * processes changing this data.
+ * bench_restores times restore, uncontended by the throttle, across
+ * file sizes, in a scratch directory.
  */
 static void
-reset_comm(void)
+bench_restores(void)
 {
-	char		 buf[4096];
-	struct stat	 st;
-	off_t		 len, offs;
-	FILE		*comm = NULL;
-	char		*p = NULL;
+	static const size_t	 sizes[] = {4096, 65536, 1 << 20, 16 << 20};
+	struct artifact		 a;
+	struct stat		 st;
+	const char		*tmp;
+	char			*dir, *src, *dst, *name;
+	unsigned char		*buf;
+	size_t			 i;
 
-	asprintf(&p, "/proc/%u/comm", pid);
-	if (NULL != (comm = fopen(p, "w"))) {
-		fwrite(WATCHER_NAME, strlen(WATCHER_NAME), 1, comm);
-		fclose(comm);
-		comm = NULL;
-	} else {
-		warn("failed to rewrite commandline");
+	if (NULL == (tmp = getenv("TMPDIR"))) {
+		tmp = "/tmp";
 	}
-
-	free(p);
-	p = NULL;
-
-	asprintf(&p, "/proc/%u/status", getpid());
-	if (-1 == stat(p, &st)) {
-		warn("failed to rewrite status");
-		goto fin;
+	dir = arena_cat(tmp, "/persist-bench.XXXXXX", NULL);
+	if (NULL == mkdtemp(dir) || NULL == (buf = calloc(1, 16 << 20))) {
+		err(EXIT_FAILURE, "bench");
+	}
+	dir = strdup(dir);
+	src = strdup(arena_cat(dir, "/src", NULL));
+	dst = strdup(arena_cat(dir, "/dst", NULL));
+	if (NULL == dir || NULL == src || NULL == dst) {
+		err(EXIT_FAILURE, "bench");
 	}
+	arena_reset();
 
-	memset(buf, 0, 4096);
-	len = st.st_size;
-	strcpy(buf, "Name:\t");
-	offs += 6;
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		memset(&a, 0, sizeof(a));
+		a.path = dst;
+		a.critical = 1;
+		a.mode = 0600;
+		a.src = open(src, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+		if (-1 == a.src || (ssize_t)sizes[i] !=
+		    write(a.src, buf, sizes[i]) || -1 == fstat(a.src, &st)) {
+			err(EXIT_FAILURE, "%s", src);
+		}
+		a.dev = st.st_dev;
+		a.id.size = sizes[i];
 
-	strcpy(buf+offs, WATCHER_NAME);
-	offs += strlen(WATCHER_NAME);
+		/* Throttling is measured by its own knobs, not here. */
+		iolimit_init(&io_global, 0, 1e15, 1e15);
+		iolimit_init(iolimit_dev(a.dev), a.dev, 1e15, 1e15);
 
-	buf[offs++] = 0xa;
+		name = strdup(arena_cat("restore_", utoa(sizes[i] / 1024), "k",
+		    NULL));
+		arena_reset();
+		bench_report(name, bench_ns(bench_restore, &a), "ns/op", 0);
+		free(name);
 
-	if (NULL == (comm = fopen(p, "r"))) {
-		warn("failed to read status");
-		goto fin;
+		close(a.src);
+		unlink(dst);
 	}
 
-	fseek(comm, name_offs, SEEK_SET);
-	if (-1 == fread(buf+offs, sizeof(char), len-name_offs, comm)) {
-		warn("failed to read status");
-		goto fin;
-	}
-	fclose(comm);
-	comm = NULL;
+	unlink(src);
+	rmdir(dir);
+	free(dst);
+	free(src);
+	free(dir);
+	free(buf);
+}
 
-	if (NULL == (comm = fopen(p, "w"))) {
-		warn("failed to write status");
-		goto fin;
-	}
 
-	if (-1 == fwrite(buf, sizeof(char), len-name_diff, comm)) {
-		warn("failed to write status");
-		goto fin;
-	}
+/*
+ * bench_hashes reports single-threaded hashing throughput across sizes.
+ */
+static void
+bench_hashes(void)
+{
+	static const size_t	 sizes[] = {4096, 1 << 20, 16 << 20};
+	struct bench_buf	 b;
+	char			*name;
+	size_t			 i;
 
-	fclose(comm);
-	comm = NULL;
-	printf("%s\n", buf);
-fin:
-	free(p);
+	if (NULL == (b.p = malloc(16 << 20))) {
+		err(EXIT_FAILURE, "bench");
+	}
+	for (i = 0; i < 16 << 20; i++) {
+		b.p[i] = (unsigned char)(i * 2654435761U >> 24);
+	}
 
-	if (NULL != comm) {
-		fclose(comm);
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		b.size = sizes[i];
+		name = strdup(arena_cat("hash_", utoa(sizes[i] / 1024), "k",
+		    NULL));
+		arena_reset();
+		bench_report(name, (double)b.size * 1e3 /
+		    bench_ns(bench_hash, &b), "MB/s", 1);
+		free(name);
 	}
+	free(b.p);
 }
+#endif
 
 
 /*
- * watch is a non-terminating loop that runs check_bin and check_run every
- * minute.
+ * bench_footprint reports the binary's size and the RSS of an idle
+ * supervisor, with the job pool but nothing to supervise.
  */
 static void
-watch(void)
+bench_footprint(void)
 {
-	while (1) {
-		sleep(60);
-		check_bin();
-		check_run();
+	struct stat	 st;
+	uint64_t	 cpu, rss;
+	pid_t		 child;
+
+	if (0 == stat("/proc/self/exe", &st)) {
+		bench_report("binary_size", (double)st.st_size, "bytes", 0);
 	}
+
+	switch (child = fork()) {
+	case -1:
+		err(EXIT_FAILURE, "bench");
+	case 0:
+		loop_init();
+		pool_init(POOL_THREADS);
+		loop_run();
+		_exit(EXIT_SUCCESS);
+	}
+	usleep(200 * 1000);
+	proc_usage(child, &cpu, &rss);
+	kill(child, SIGKILL);
+	waitpid(child, NULL, 0);
+	bench_report("rss_idle", (double)rss, "KiB", 0);
 }
 
 
 /*
- * spam is a non-terminating loop that writes syslog messages every hour. For
- * maxmimum fun, it uses LOG_EMERG to spam on every console.
+ * bench runs every benchmark, printing tab-separated rows of name,
+ * value, unit, and, given a baseline, the limit and whether it was
+ * met. Its output makes a baseline for later runs. It returns non-zero
+ * if anything regressed.
  */
-static void
-spam(void)
+static int
+bench(const char *baseline)
 {
-	while (1) {
-		syslog(LOG_EMERG, "hey! you!");
-		sleep(3600);
+#ifndef PERSIST_SMALL
+	static struct loopstat	 st = {.name = "bench"};
+	struct handler		 h = {-1, "bench", bench_handler, &st, 0};
+	struct conn		 c;
+	struct job		 j = {.fn = bench_job, .class = JOB_PROBE};
+#endif
+
+	if (NULL != baseline) {
+		bench_load(baseline);
 	}
+	pid = getpid();
+	printf("bench\tvalue\tunit\tlimit\tstatus\n");
+
+	bench_footprint();
+#ifndef PERSIST_SMALL
+	bench_report("proc_exe", bench_ns(bench_proc_exe, NULL), "ns/op", 0);
+	bench_report("proc_stat", bench_ns(bench_proc_stat, NULL), "ns/op",
+	    0);
+	bench_restores();
+	bench_hashes();
+
+	atomic_store(&trace_on, 1);
+	bench_report("trace_record", bench_ns(bench_trace_record, NULL),
+	    "ns/op", 0);
+	atomic_store(&trace_on, 0);
+	memset(&c, 0, sizeof(c));
+	bench_report("trace_encode", bench_ns(bench_trace_encode, &c),
+	    "ns/op", 0);
+	bench_report("ctl_status", bench_ns(bench_status, &c), "ns/op", 0);
+	free(c.out);
+
+	pool_init(POOL_THREADS);
+	bench_report("pool_job", bench_ns(bench_pool, &j), "ns/op", 0);
+
+	loop_init();
+	if (-1 == (h.fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC))) {
+		err(EXIT_FAILURE, "bench");
+	}
+	add_handler(&h);
+	bench_report("dispatch_epoll", bench_ns(bench_dispatch, &h), "ns/op",
+	    0);
+	bench_report("dispatch_timer", bench_ns(bench_timer, NULL), "ns/op",
+	    0);
+#endif
+
+	return bench_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 
@@ -299,10 +7501,40 @@ int
 main(int argc, char *argv[])
 {
 	char	*nargv[2] = {WATCHER_NAME, NULL};
+	int	 restarted = 0;
+
+	if ((2 == argc || 3 == argc) && 0 == strcmp(argv[1], "bench")) {
+		return bench(argv[2]);
+	}
+#ifndef PERSIST_SMALL
+	if (3 == argc && 0 == strcmp(argv[1], "hashbench")) {
+		hash_bench(argv[2]);
+		return EXIT_SUCCESS;
+	}
+	if (5 == argc && 0 == strcmp(argv[1], "scalebench")) {
+		scale_bench(strtoul(argv[2], NULL, 10), atof(argv[3]),
+		    atof(argv[4]));
+		return EXIT_SUCCESS;
+	}
+	if (3 == argc && 0 == strcmp(argv[1], "simulate")) {
+		return simulate(argv[2]);
+	}
+	if (4 == argc && 0 == strcmp(argv[1], "idle")) {
+		idle((uint32_t)strtoul(argv[2], NULL, 10), atoi(argv[3]));
+	}
+#endif
+	if (2 == argc && 0 != strcmp(argv[0], WATCHER_NAME)) {
+		return ctl_client(argv[1]);
+	}
 
 	if (0 == strcmp(argv[0], WATCHER_NAME)) {
 		pid = getppid();
 		reset_comm();
+	} else if (NULL != getenv(WATCHER_ENV)) {
+		/* The watcher that restarted us is still running. */
+		unsetenv(WATCHER_ENV);
+		pid = getpid();
+		restarted = 1;
 	} else {
 		daemon(1, 1);
 		pid = getpid();
@@ -311,7 +7543,9 @@ main(int argc, char *argv[])
 	init();
 	openlog("persist", LOG_CONS|LOG_NDELAY, LOG_DAEMON);
 
-	if (pid == getpid()) {
+	if (restarted) {
+		spam();
+	} else if (pid == getpid()) {
 		switch (fork()) {
 		case -1:
 			/* Generate a core dump. */
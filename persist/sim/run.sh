@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Runs each scenario here under persist's simulator and compares what
+# it did, the event log up to the status tables, with the .out beside
+# it. With -u, the .out files are rewritten instead. Against a persist
+# built with -DALLOC_CHECK, a scenario also fails if it allocates
+# anything after its steady line.
+#
+# Usage: run.sh [-u] PERSIST
+
+update=0
+if [ "$1" = "-u" ]; then
+	update=1
+	shift
+fi
+if [ $# -ne 1 ]; then
+	echo "usage: $0 [-u] PERSIST" >&2
+	exit 2
+fi
+
+persist=$1
+dir=$(dirname "$0")
+tmp=$(mktemp) || exit 2
+trap 'rm -f "$tmp"' EXIT
+failed=0
+
+for sim in "$dir"/*.sim; do
+	out=${sim%.sim}.out
+	"$persist" simulate "$sim" > "$tmp"
+	rc=$?
+	got=$(sed '/^op /,$d' "$tmp")
+	if [ $update -eq 1 ]; then
+		printf '%s\n' "$got" > "$out"
+	elif ! printf '%s\n' "$got" | diff -u "$out" -; then
+		echo "FAIL $sim"
+		failed=1
+	elif [ $rc -ne 0 ]; then
+		echo "FAIL $sim: exited $rc"
+		failed=1
+	else
+		echo "ok   $sim"
+	fi
+done
+
+exit $failed